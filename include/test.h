@@ -1,5 +1,85 @@
 #include <string>
+#include <cstdint>
 
 namespace memory {
+    // a precomputed scope, cheap to switch to
+    struct ScopeHandle
+    {
+        uint32_t id;
+    };
+
     void set_scope(std::string s);
-}
\ No newline at end of file
+    void set_scope(const char* s);
+    void set_scope(ScopeHandle h);
+
+    // look up a scope once, to switch to it later with set_scope(ScopeHandle)
+    ScopeHandle get_scope_handle(const char* s);
+
+    // the current scope of the calling thread
+    ScopeHandle get_scope();
+
+    // Nested scopes: names with '/' form a tree ("pipeline/service/module"),
+    // and push_scope enters a child of the current scope, which pop_scope
+    // leaves again. Totals can be rolled up to any level of the tree.
+    void push_scope(const char* s);
+    void pop_scope();
+
+    // Called on the allocating thread, right after the allocation that
+    // took a scope over its budget, with the scope name, its live heap
+    // bytes and the budget. Its own allocations are tracked as usual.
+    typedef void (*BudgetCallback)(const char* scope, size_t bytes, size_t budget, void* arg);
+
+    // Set a soft limit on the live heap bytes of a scope, 0 to remove it.
+    // Each time the scope goes over it, the callback is called once, or
+    // a warning is logged if there is none. Memory is counted in the
+    // scope itself, not its children.
+    void set_scope_budget(const char* s, size_t budget,
+                          BudgetCallback callback = nullptr, void* arg = nullptr);
+
+    // set a scope for the lifetime of the guard, then restore the previous one
+    class ScopeGuard
+    {
+    public:
+        explicit ScopeGuard(ScopeHandle h) : prev_(get_scope()) { set_scope(h); }
+        explicit ScopeGuard(const char* s) : prev_(get_scope()) { set_scope(s); }
+        ~ScopeGuard() { set_scope(prev_); }
+
+        // non-copyable, non-movable
+        ScopeGuard(const ScopeGuard&) = delete;
+        ScopeGuard(ScopeGuard&&) = delete;
+        ScopeGuard& operator=(const ScopeGuard&) = delete;
+        ScopeGuard& operator=(ScopeGuard&&) = delete;
+    private:
+        ScopeHandle prev_;
+    };
+}
+
+namespace memory {
+    // enter a child scope for the lifetime of the guard
+    class NestedScope
+    {
+    public:
+        explicit NestedScope(const char* s) { push_scope(s); }
+        ~NestedScope() { pop_scope(); }
+
+        // non-copyable, non-movable
+        NestedScope(const NestedScope&) = delete;
+        NestedScope(NestedScope&&) = delete;
+        NestedScope& operator=(const NestedScope&) = delete;
+        NestedScope& operator=(NestedScope&&) = delete;
+    };
+}
+
+// set a scope until the end of the enclosing block, looking up the name
+// only the first time this line runs
+#define MEMORY_SCOPE_CONCAT_(a,b) a##b
+#define MEMORY_SCOPE_CONCAT(a,b) MEMORY_SCOPE_CONCAT_(a,b)
+#define MEMORY_SCOPE(name) \
+    static const memory::ScopeHandle MEMORY_SCOPE_CONCAT(memory_scope_handle_,__LINE__) \
+        = memory::get_scope_handle(name); \
+    memory::ScopeGuard MEMORY_SCOPE_CONCAT(memory_scope_guard_,__LINE__) \
+        (MEMORY_SCOPE_CONCAT(memory_scope_handle_,__LINE__))
+
+// enter a child scope until the end of the enclosing block
+#define MEMORY_NESTED_SCOPE(name) \
+    memory::NestedScope MEMORY_SCOPE_CONCAT(memory_nested_scope_,__LINE__)(name)
@@ -0,0 +1,44 @@
+import argparse
+import socket
+
+def query(path):
+    """
+    Read the current per-scope usage of a running process, from the
+    socket set with MEMSCOPETRACK_SOCKET.
+
+    Args:
+        path (str): Path of the socket.
+
+    Returns:
+        dict: {series:{scope:value}}, with series 'heap' for live heap bytes
+    """
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+
+    ret = {'heap':{}}
+    for line in data.decode('utf-8','replace').split('\n'):
+        if not line or line.startswith('---'):
+            continue
+        series = 'heap'
+        if line.startswith('+'): # another series: +<series> <scope>|<value>
+            series,line = line[1:].split(' ',1)
+        scope,value = line.rsplit('|',1)
+        ret.setdefault(series,{})[scope] = int(value)
+    return ret
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('socket', type=str, help='MEMSCOPETRACK_SOCKET of the process')
+    parser.add_argument('--series', type=str, default='heap', help='series to print')
+    args = parser.parse_args()
+
+    values = query(args.socket).get(args.series,{})
+    for scope in sorted(values, key=values.get, reverse=True):
+        print(scope, values[scope])
@@ -0,0 +1,65 @@
+import argparse
+import mmap
+import struct
+import time
+
+# see the shared memory segment layout in src/format.h
+HEADER = struct.Struct('<4sIQQIIQQQQQ')
+SCOPE = struct.Struct('<QQQQQQ')
+FIELDS = ('heap', 'peak', 'mapped', 'allocs', 'frees', 'allocated')
+
+# attempts to read a snapshot while one is being written, and the wait
+# between them in seconds
+RETRIES = 1000
+RETRY_WAIT = 0.001
+
+def read_segment(name):
+    """
+    Read the per-scope values published with MEMSCOPETRACK_SHM.
+
+    Args:
+        name (str): Segment name, as given in MEMSCOPETRACK_SHM.
+
+    Returns:
+        dict: {scope:{field:value}}, with the fields of FIELDS
+
+    Raises:
+        Exception: if no consistent snapshot could be read within a second,
+            e.g. because the process died while writing one
+    """
+    with open('/dev/shm/'+name, 'rb') as f:
+        mem = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        for attempt in range(RETRIES):
+            if attempt:
+                time.sleep(RETRY_WAIT)
+            (magic, version, seq, usec, capacity, scopes, names_offset,
+             names_size, names_used, values_offset, truncated) = HEADER.unpack_from(mem, 0)
+            if magic != b'MSTS':
+                raise Exception('not a mem-scope-track segment')
+            if seq & 1:
+                continue # a snapshot is being written
+            ret = {}
+            pos = names_offset
+            for scope_id in range(1, scopes):
+                length, = struct.unpack_from('<I', mem, pos)
+                scope = mem[pos+4:pos+4+length].decode('utf-8','replace')
+                pos += 4+length
+                values = SCOPE.unpack_from(mem, values_offset+scope_id*SCOPE.size)
+                ret[scope] = dict(zip(FIELDS, values))
+            if HEADER.unpack_from(mem, 0)[2] == seq:
+                return ret
+        raise Exception('no consistent snapshot in segment '+name)
+    finally:
+        mem.close()
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('name', type=str, help='MEMSCOPETRACK_SHM of the process')
+    parser.add_argument('--field', type=str, default='heap', choices=FIELDS,
+                        help='value to print')
+    args = parser.parse_args()
+
+    scopes = read_segment(args.name)
+    for scope in sorted(scopes, key=lambda k:scopes[k][args.field], reverse=True):
+        print(scope, scopes[scope][args.field])
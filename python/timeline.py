@@ -1,11 +1,10 @@
 import argparse
 import gzip
+import io
+from array import array
 
-import matplotlib
-matplotlib.use('Agg')
-import matplotlib.pyplot as plt
-
-def graph_timeline(timeline, filename, log=False, limit=10, exclude=None):
+def graph_timeline(timeline, filename, log=False, limit=10, exclude=None,
+                   ylabel='Memory (MB)'):
     """
     Graph a memory timeline.
 
@@ -15,6 +14,7 @@ def graph_timeline(timeline, filename, log=False, limit=10, exclude=None):
         log (bool): Make the y-axis log scale.
         limit (int): Number of lines to display (from highest to lowest).
         exclude (iterable): Iterable of names to exclude.
+        ylabel (str): Label of the y-axis.
     """
 
     if not exclude:
@@ -31,19 +31,136 @@ def graph_timeline(timeline, filename, log=False, limit=10, exclude=None):
             series[k]['values'].append(data[k])
     highest_series = sorted(series,key=lambda k:max(series[k]['values']),reverse=True)[:limit]
 
-    plot([series[k] for k in highest_series], filename, log=log)
+    plot([series[k] for k in highest_series], filename, log=log, ylabel=ylabel)
+
+class Downsampler(object):
+    """
+    Fold a timeline into at most a fixed number of time buckets per scope,
+    as it is read, so memory does not grow with the length of the run.
+
+    Each bucket keeps the highest value of a scope within it, so short
+    peaks stay visible. Buckets start 1 ms wide and double in width
+    whenever the timeline outgrows them. The highest value of each scope
+    is kept on the way, for picking the top scopes without another pass.
+
+    Args:
+        points (int): Most buckets to keep.
+    """
+    def __init__(self, points=2000):
+        self.points = max(2, points)
+        self.width = 0.001
+        self.t0 = None
+        self.times = array('d')  # time of the first sample per bucket, nan if none
+        self.series = {}         # scope -> array of the bucket maxima
+        self.peaks = {}          # scope -> highest value
+
+    def add(self, t, data):
+        """
+        Fold in one snapshot.
+
+        Args:
+            t (float): Time of the snapshot.
+            data (dict): {scope:value}
+        """
+        if self.t0 is None:
+            self.t0 = t
+        bucket = int((t-self.t0)/self.width)
+        while bucket >= self.points:
+            self._merge()
+            bucket = int((t-self.t0)/self.width)
+        if bucket >= len(self.times):
+            self.times.extend([float('nan')]*(bucket+1-len(self.times)))
+        if self.times[bucket] != self.times[bucket]: # nan, first sample
+            self.times[bucket] = t
+        for k,v in data.items():
+            values = self.series.get(k)
+            if values is None:
+                values = self.series[k] = array('d')
+            if len(values) <= bucket:
+                values.extend([0.0]*(bucket+1-len(values)))
+            if v > values[bucket]:
+                values[bucket] = v
+            if k not in self.peaks or v > self.peaks[k]:
+                self.peaks[k] = v
+
+    def _merge(self):
+        """Halve the number of buckets by merging neighbours."""
+        times = array('d')
+        for i in range(0,len(self.times),2):
+            first = self.times[i]
+            times.append(first if first == first or i+1 >= len(self.times) else self.times[i+1])
+        self.times = times
+        for k,values in self.series.items():
+            merged = array('d', (max(values[i:i+2]) for i in range(0,len(values),2)))
+            self.series[k] = merged
+        self.width *= 2
+
+    def top(self, limit=10, exclude=None):
+        """
+        Scopes with the highest values, from highest to lowest.
+
+        Args:
+            limit (int): Number of scopes.
+            exclude (iterable): Names to leave out.
+
+        Returns:
+            list: scope names
+        """
+        exclude = set(exclude) if exclude else set()
+        names = [k for k in self.peaks if k not in exclude]
+        return sorted(names,key=lambda k:self.peaks[k],reverse=True)[:limit]
+
+    def get(self, scope):
+        """
+        The downsampled series of one scope.
+
+        Returns:
+            dict: {'times':[...],'values':[...],'label':scope}, leaving
+                  out buckets without any snapshot
+        """
+        values = self.series.get(scope, array('d'))
+        times = []
+        out = []
+        for i,t in enumerate(self.times):
+            if t == t:
+                times.append(t)
+                out.append(values[i] if i < len(values) else 0.0)
+        return {'times':times,'values':out,'label':scope}
+
+def graph_downsampled(downsampled, filename, log=False, limit=10, exclude=None,
+                      ylabel='Memory (MB)'):
+    """
+    Graph a downsampled timeline.
+
+    Args:
+        downsampled (Downsampler): The folded timeline.
+        filename (str): A filename to write to.
+        log (bool): Make the y-axis log scale.
+        limit (int): Number of lines to display (from highest to lowest).
+        exclude (iterable): Iterable of names to exclude.
+        ylabel (str): Label of the y-axis.
+    """
+    series = [downsampled.get(k) for k in downsampled.top(limit, exclude)]
+    if series:
+        plot(series, filename, log=log, ylabel=ylabel)
 
-def plot(series, filename, log=False):
+def plot(series, filename, log=False, ylabel='Memory (MB)'):
     """
     Plot a series to file.
 
     Args:
         series (list): A sorted series, from max value to low value.
         filename (str): Output filename.
+        ylabel (str): Label of the y-axis.
     """
+    # only plotting needs matplotlib, not the readers
+    import matplotlib
+    matplotlib.use('Agg')
+    import matplotlib.pyplot as plt
+
     fig = plt.figure()
     ax = fig.add_subplot(111)
-    ax.set_ylabel('Memory (MB)')
+    ax.set_ylabel(ylabel)
     ax.set_xlabel('Time (s)')
 
     max_mem = max(series[0]['values'])
@@ -65,39 +182,300 @@ def plot(series, filename, log=False):
 
     plt.savefig(filename, dpi=300, bbox_extra_artists=(lgd,), bbox_inches='tight')
 
-def import_data(filename):
+def read_varint(data, pos):
+    """
+    Decode a varint.
+
+    Args:
+        data (bytes): Input buffer.
+        pos (int): Offset of the varint.
+
+    Returns:
+        tuple: (value, offset after the varint)
+    """
+    value = 0
+    shift = 0
+    while True:
+        byte = bytearray(data[pos:pos+1])
+        if not byte:
+            raise EOFError('truncated varint')
+        pos += 1
+        value |= (byte[0] & 0x7f) << shift
+        if not byte[0] & 0x80:
+            return value, pos
+        shift += 7
+
+# series kinds in the binary format, besides heap bytes (see src/format.h)
+SERIES_KINDS = {1:'mapped', 2:'allocs', 3:'frees', 4:'allocated', 5:'peak'}
+SERIES_KINDS.update({32+c:'size%d'%c for c in range(32)})
+SERIES_KINDS.update({64+n:'node%d'%n for n in range(64)})
+THREAD_SERIES = 1<<32 # kinds of the per-thread breakdown, from thread id 0
+
+# series counting bytes, imported in MB; the others are plain counts
+BYTE_SERIES = {'heap', 'mapped', 'allocated', 'peak'}
+
+def series_name(kind):
+    """Name of a binary series kind (see src/format.h)."""
+    if kind >= THREAD_SERIES:
+        return 'thread%d'%(kind-THREAD_SERIES)
+    return SERIES_KINDS.get(kind, 'unknown')
+
+def is_bytes(series):
+    """Whether a series counts bytes, like the heap and its breakdowns."""
+    return (series in BYTE_SERIES or series.startswith('node')
+            or series.startswith('thread'))
+
+def iter_rollup(timeline, depth):
     """
-    Import data from gzipped file.
+    Sum nested scopes ("a/b/c") into their ancestors at a given depth.
 
     Args:
-        filename (str): Name of gzipped file.
+        timeline (iterable): (time,{scope:value}) tuples.
+        depth (int): Number of path components to keep (1 is the top level).
+
+    Yields:
+        tuple: (time,{scope:value})
+    """
+    for t,data in timeline:
+        out = {}
+        for k,v in data.items():
+            if not k.startswith('stack:'): # stack names are not paths
+                k = '/'.join(k.split('/')[:depth])
+            out[k] = out.get(k,0)+v
+        yield (t,out)
+
+def rollup(timeline, depth):
+    """
+    Like iter_rollup, as a list.
 
     Returns:
         list: A list of (time,{scope:value}) tuples.
     """
-    ret = []
+    return list(iter_rollup(timeline, depth))
+
+def iter_rates(timeline):
+    """
+    Turn a timeline of running totals (allocs, frees, allocated, sizes)
+    into per-second rates between snapshots.
+
+    Args:
+        timeline (iterable): (time,{scope:value}) tuples.
+
+    Yields:
+        tuple: (time,{scope:rate}), one fewer than the input
+    """
+    prev_t = None
+    prev = {}
+    for t,data in timeline:
+        if prev_t is not None and t > prev_t:
+            yield (t,{k:(v-prev.get(k,0))/(t-prev_t) for k,v in data.items()})
+        prev_t = t
+        prev = data
+
+def rates(timeline):
+    """
+    Like iter_rates, as a list.
+
+    Returns:
+        list: A list of (time,{scope:rate}) tuples, one shorter.
+    """
+    return list(iter_rates(timeline))
+
+class _Stream(object):
+    """
+    Buffered reader of the binary format, over a file object.
+
+    Args:
+        f (file): Positioned after the magic.
+        size (int): Bytes to read at a time.
+    """
+    def __init__(self, f, size=1<<20):
+        self.f = f
+        self.size = size
+        self.buf = bytearray()
+        self.pos = 0
+
+    def _fill(self, n):
+        """Have at least n unread bytes buffered, or raise EOFError."""
+        self.buf = self.buf[self.pos:] + bytearray(self.f.read(max(n,self.size)))
+        self.pos = 0
+        if len(self.buf) < n:
+            raise EOFError('truncated record')
+
+    def at_end(self):
+        if self.pos < len(self.buf):
+            return False
+        try:
+            self._fill(1)
+        except EOFError:
+            return True
+        return False
+
+    def read(self, n):
+        if self.pos+n > len(self.buf):
+            self._fill(n)
+        out = self.buf[self.pos:self.pos+n]
+        self.pos += n
+        return out
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            if self.pos >= len(self.buf):
+                self._fill(1)
+            byte = self.buf[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7f) << shift
+            if not byte & 0x80:
+                return value
+            shift += 7
+
+def iter_binary(f, series='heap'):
+    """
+    Read data in the binary format (see src/format.h), one snapshot at
+    a time.
+
+    Args:
+        f (file): File object, positioned after the magic.
+        series (str): Series to read: heap, or one of SERIES_KINDS.
+
+    Yields:
+        tuple: (time,{scope:value})
+    """
+    stream = _Stream(f)
+    try:
+        version = stream.read(1)[0]
+    except EOFError:
+        version = None
+    if version != 1:
+        raise Exception('unsupported binary format version')
+    names = {}
+    values = {'heap':{}}
+    t = 0
+    pending = False
+    scale = 1000000.0 if is_bytes(series) else 1
+    def snapshot():
+        return (t/1000000.0,
+                {names[k]:v/scale for k,v in values.get(series,{}).items()})
+    def read_changes(current):
+        count = stream.varint()
+        scope_id = 0
+        for _ in range(count):
+            scope_id += stream.varint()
+            delta = stream.varint()
+            current[scope_id] = current.get(scope_id,0) + ((delta >> 1) ^ -(delta & 1))
+    try:
+        while not stream.at_end():
+            kind = bytes(stream.read(1))
+            if kind == b'S': # scope definition
+                scope_id = stream.varint()
+                length = stream.varint()
+                names[scope_id] = bytes(stream.read(length)).decode('utf-8','replace')
+                values['heap'][scope_id] = 0
+            elif kind == b'T': # snapshot of changed scopes
+                if pending:
+                    yield snapshot()
+                dt = stream.varint()
+                read_changes(values['heap'])
+                t += dt
+                pending = True
+            elif kind == b'V': # another series of the same snapshot
+                name = series_name(stream.varint())
+                read_changes(values.setdefault(name,{}))
+            else:
+                raise Exception('bad record type %r'%kind)
+    except EOFError:
+        pass # a truncated last record, from a job that did not exit cleanly
+    if pending:
+        yield snapshot()
+
+def import_binary(data, series='heap'):
+    """
+    Import data in the binary format (see src/format.h).
+
+    Args:
+        data (bytes): File contents after the magic.
+        series (str): Series to import: heap, or one of SERIES_KINDS.
+
+    Returns:
+        list: A list of (time,{scope:value}) tuples.
+    """
+    return list(iter_binary(io.BytesIO(data), series=series))
+
+def _lines(f):
+    """Lines of a file, up to where a gzip stream was cut off."""
+    try:
+        for line in f:
+            yield line
+    except EOFError:
+        pass # the last gzip member of a job that did not exit cleanly
+
+def iter_data(filename, series='heap'):
+    """
+    Read data from a text or binary file, optionally gzipped, one
+    snapshot at a time.
+
+    Args:
+        filename (str): Name of the file.
+        series (str): Series to read: heap (default), or another
+                      per-scope series such as mapped or allocs.
+
+    Yields:
+        tuple: (time,{scope:value})
+    """
     t = 0
     time_series = {}
+    pending = False
+    scale = 1000000.0 if is_bytes(series) else 1
     if filename.endswith('.gz'):
         file_open = gzip.open
     else:
         file_open = open
     with file_open(filename, 'rb') as f:
-        for line in f:
-            line = line.strip()
+        if f.read(4) == b'MSTB':
+            for snapshot in iter_binary(f, series=series):
+                yield snapshot
+            return
+        f.seek(0)
+        for line in _lines(f):
+            line = line.decode('utf-8','replace').strip()
             if not line:
                 continue
             if line.startswith('---'): # time code in microseconds
-                if time_series:
-                    ret.append((t,time_series))
+                if pending:
+                    yield (t,dict(time_series))
+                # every heap value is listed, and the values of the other
+                # series only when they change
+                if series == 'heap':
                     time_series = {}
                 t = float(line[3:])/1000000.0
+                pending = True
+                continue
+            if line.startswith('+'): # another series: +<series> <scope>|<value>
+                name,line = line[1:].split(' ',1)
+                if name != series:
+                    continue
+            elif series != 'heap':
                 continue
-            scope,value = line.rsplit('|',1) # scope, memory in bytes
-            time_series[scope] = float(value)/1000000.0
-    if time_series:
-        ret.append((t,time_series))
-    return ret
+            scope,value = line.rsplit('|',1) # scope, value (bytes or count)
+            time_series[scope] = float(value)/scale
+    if pending:
+        yield (t,time_series)
+
+def import_data(filename, series='heap'):
+    """
+    Import data from a text or binary file, optionally gzipped.
+
+    Args:
+        filename (str): Name of the file.
+        series (str): Series to import: heap (default), or another
+                      per-scope series such as mapped or allocs.
+
+    Returns:
+        list: A list of (time,{scope:value}) tuples.
+    """
+    return list(iter_data(filename, series=series))
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
@@ -105,9 +483,31 @@ if __name__ == '__main__':
     parser.add_argument('--outfile', default=None, type=str, help='outfile name')
     parser.add_argument('--log', action='store_true', help='plot in log scale')
     parser.add_argument('--limit', type=int, default=15, help='top # entries')
+    parser.add_argument('--series', type=str, default='heap',
+                        help='series to plot: heap (default), peak, mapped, allocs, '
+                             'frees, allocated, size<N> for the allocations '
+                             'of 2^N to 2^(N+1) bytes, or with MEMSCOPETRACK_BREAKDOWN '
+                             'node<N> or thread<tid>')
+    parser.add_argument('--depth', type=int, default=0,
+                        help='roll nested scopes up to this depth (default: leaves)')
+    parser.add_argument('--rate', action='store_true',
+                        help='plot the per-second rate of a running total')
+    parser.add_argument('--points', type=int, default=2000,
+                        help='most points per line; longer timelines are downsampled '
+                             'as they are read, keeping the highest values')
     args = parser.parse_args()
 
-    data = import_data(args.filename)
+    # stream the file through, so memory does not depend on its length
+    data = iter_data(args.filename, series=args.series)
+    if args.depth > 0:
+        data = iter_rollup(data, args.depth)
+    ylabel = 'Memory (MB)' if is_bytes(args.series) else 'Count'
+    if args.rate:
+        data = iter_rates(data)
+        ylabel += ' / s'
+    downsampled = Downsampler(points=args.points)
+    for t,snapshot in data:
+        downsampled.add(t, snapshot)
 
     outfile_name = args.outfile if args.outfile else args.filename.replace('.gz','')+'.png'
-    graph_timeline(data, outfile_name, log=args.log, limit=args.limit)
+    graph_downsampled(downsampled, outfile_name, log=args.log, limit=args.limit, ylabel=ylabel)
@@ -0,0 +1,163 @@
+// Allocation workload for the tracker benchmarks, run by run_bench.py
+// with and without the tracker preloaded.
+//
+//   bench_alloc <threads> <small|mixed|large> <ops per thread> <ops per scope>
+//
+// Each thread keeps a window of live blocks, replacing a random one per
+// operation, and switches between scopes every <ops per scope> operations
+// (0 to stay outside any scope). Prints the time per operation and the
+// peak RSS of the process.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+
+#include "test.h"
+
+namespace {
+    constexpr size_t WINDOW = 4096;
+    constexpr size_t NUM_SCOPES = 16;
+
+    enum class Dist { small, mixed, large };
+
+    struct Rng
+    {
+        uint64_t state;
+        inline uint64_t next()
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+        inline size_t between(size_t lo, size_t hi)
+        {
+            return lo + next() % (hi - lo + 1);
+        }
+    };
+
+    // small: 16-256 bytes; mixed: mostly small, some up to 64KB;
+    // large: 4KB-256KB, partly above the mmap threshold
+    inline size_t next_size(Rng& rng, Dist dist)
+    {
+        switch (dist) {
+            case Dist::small:
+                return rng.between(16, 256);
+            case Dist::mixed: {
+                unsigned r = rng.next() % 100;
+                if (r < 80) {
+                    return rng.between(16, 256);
+                } else if (r < 98) {
+                    return rng.between(257, 4096);
+                }
+                return rng.between(4097, 65536);
+            }
+            case Dist::large:
+                return rng.between(4096, 262144);
+        }
+        return 16;
+    }
+
+    // peak RSS of this process in KB. Not getrusage: its maximum carries
+    // over from the parent through fork and exec.
+    long peak_rss()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                return atol(line.c_str() + 6);
+            }
+        }
+        return 0;
+    }
+
+    void worker(unsigned id, Dist dist, size_t ops, size_t per_scope,
+                const std::vector<memory::ScopeHandle>& handles,
+                const std::vector<std::string>& names,
+                std::atomic<unsigned>& ready, double& elapsed)
+    {
+        Rng rng{0x9E3779B97F4A7C15ull * (id + 1)};
+        std::vector<void*> window(WINDOW, nullptr);
+        ready.fetch_sub(1);
+        while (ready.load() != 0) {
+            std::this_thread::yield();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i=0;i<ops;i++) {
+            if (per_scope != 0 && i % per_scope == 0) {
+                size_t s = rng.next() % NUM_SCOPES;
+                // alternate between the handle and the lookup by name
+                if (i / per_scope % 2) {
+                    memory::set_scope(handles[s]);
+                } else {
+                    memory::set_scope(names[s].c_str());
+                }
+            }
+            void*& slot = window[rng.next() % WINDOW];
+            free(slot);
+            size_t size = next_size(rng, dist);
+            slot = malloc(size);
+            static_cast<volatile char*>(slot)[0] = 1;
+        }
+        for(void* p : window) {
+            free(p);
+        }
+        elapsed = std::chrono::duration<double, std::nano>(
+                      std::chrono::steady_clock::now() - start).count();
+        memory::set_scope("");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 5) {
+        fprintf(stderr, "usage: %s <threads> <small|mixed|large> <ops per thread> <ops per scope>\n", argv[0]);
+        return 1;
+    }
+    unsigned threads = std::max(1, atoi(argv[1]));
+    Dist dist;
+    if (strcmp(argv[2], "small") == 0) {
+        dist = Dist::small;
+    } else if (strcmp(argv[2], "mixed") == 0) {
+        dist = Dist::mixed;
+    } else if (strcmp(argv[2], "large") == 0) {
+        dist = Dist::large;
+    } else {
+        fprintf(stderr, "unknown size distribution %s\n", argv[2]);
+        return 1;
+    }
+    size_t ops = strtoull(argv[3], nullptr, 10);
+    size_t per_scope = strtoull(argv[4], nullptr, 10);
+
+    std::vector<std::string> names;
+    std::vector<memory::ScopeHandle> handles;
+    for(size_t i=0;i<NUM_SCOPES;i++) {
+        names.push_back("bench" + std::to_string(i));
+        handles.push_back(memory::get_scope_handle(names.back().c_str()));
+    }
+
+    std::atomic<unsigned> ready(threads);
+    std::vector<double> elapsed(threads, 0);
+    std::vector<std::thread> pool;
+    for(unsigned t=0;t<threads;t++) {
+        pool.emplace_back(worker, t, dist, ops, per_scope, std::cref(handles),
+                          std::cref(names), std::ref(ready), std::ref(elapsed[t]));
+    }
+    for(auto& t : pool) {
+        t.join();
+    }
+
+    // the slowest thread, per operation of one thread
+    double ns = *std::max_element(elapsed.begin(), elapsed.end()) / ops;
+    printf("bench ns/op %.1f rss_kb %ld\n", ns, peak_rss());
+    return 0;
+}
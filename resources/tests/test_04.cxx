@@ -0,0 +1,24 @@
+#include <memory>
+#include <thread>
+#include <vector>
+#include "test.h"
+
+int main() {
+    // allocate on worker threads, free on the main thread
+    std::vector<int*> ptrs(8, nullptr);
+    std::vector<std::thread> threads;
+    for(size_t i=0;i<ptrs.size();i++) {
+        threads.emplace_back([&ptrs,i](){
+            memory::set_scope("main");
+            ptrs[i] = new int[100];
+        });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+    for(auto p : ptrs) {
+        delete[] p;
+    }
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#include <memory>
+#include <thread>
+#include "test.h"
+
+// stores through a volatile pointer keep the leaks from being elided
+static char* volatile sink;
+
+int main() {
+    // a worker scope must not leak into the main thread
+    std::thread worker([](){
+        memory::ScopeGuard guard("worker");
+        sink = new char[50];
+    });
+    worker.join();
+
+    memory::ScopeHandle main_scope = memory::get_scope_handle("main");
+    memory::set_scope(main_scope);
+    {
+        MEMORY_SCOPE("inner");
+        sink = new char[100];
+    }
+    // back in the main scope
+    sink = new char[10];
+
+    memory::set_scope("none");
+    delete new char[1000];
+
+    return 0;
+}
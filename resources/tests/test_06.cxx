@@ -0,0 +1,50 @@
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <malloc.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("main");
+
+    // tagged blocks keep malloc's alignment and usable size
+    void* a = malloc(24);
+    if (reinterpret_cast<uintptr_t>(a) % 16 != 0 || malloc_usable_size(a) < 24) {
+        return 1;
+    }
+    // the header magic sits just before the returned pointer
+    if (static_cast<uint32_t*>(a)[-1] != 0x4d535448) {
+        return 5;
+    }
+    free(a);
+
+    char* b = static_cast<char*>(calloc(10, 10));
+    for(int i=0;i<100;i++) {
+        if (b[i] != 0) {
+            return 2;
+        }
+    }
+    memset(b, 1, 100);
+    b = static_cast<char*>(realloc(b, 1000));
+    if (b[99] != 1 || malloc_usable_size(b) < 1000) {
+        return 3;
+    }
+
+    // a block freed from another scope still leaves its own scope
+    memory::set_scope("other");
+    free(b);
+
+    // aligned blocks carry a header too
+    void* c = nullptr;
+    if (posix_memalign(&c, 256, 300) != 0 || reinterpret_cast<uintptr_t>(c) % 256 != 0
+        || malloc_usable_size(c) < 300) {
+        return 6;
+    }
+    c = realloc(c, 600);
+    free(c);
+    free(aligned_alloc(4096, 4096));
+
+    memory::set_scope("main");
+    void* leak = malloc(7);
+    return leak ? 0 : 4;
+}
@@ -0,0 +1,17 @@
+env = {'MEMSCOPETRACK_HEADER': '1'}
+
+def verify(output):
+    expected = {'main':'7'}
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = size
+            continue
+        if line.startswith('Unfreed memory'):
+            scopes = True
+    if found != expected:
+        print("unfreed memory",found,"expected",expected)
+        raise Exception('wrong unfreed memory')
@@ -0,0 +1,24 @@
+#include <cstdlib>
+#include "test.h"
+
+int main() {
+    memory::set_scope("main");
+
+    // 1MB in small blocks, and one large block that is always sampled
+    for(int i=0;i<10000;i++) {
+        if (!malloc(100)) {
+            return 1;
+        }
+    }
+    if (!malloc(1000000)) {
+        return 1;
+    }
+
+    // frees of unsampled blocks must not disturb the totals
+    memory::set_scope("freed");
+    for(int i=0;i<10000;i++) {
+        free(malloc(100));
+    }
+
+    return 0;
+}
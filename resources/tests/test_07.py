@@ -0,0 +1,18 @@
+env = {'MEMSCOPETRACK_SAMPLE': '1024'}
+
+def verify(output):
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = int(size)
+            continue
+        if line.startswith('Unfreed memory'):
+            scopes = True
+    if 'freed' in found:
+        raise Exception('unfreed memory in scope freed: %d'%found['freed'])
+    # the estimate should be well within 15% of the true 2MB
+    if not 1700000 < found.get('main',0) < 2300000:
+        raise Exception('sampled estimate out of range: %d'%found.get('main',0))
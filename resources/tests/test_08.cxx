@@ -0,0 +1,45 @@
+#include <cstdlib>
+#include <cstdint>
+#include <malloc.h>
+#include "test.h"
+
+// allocate with every aligned entry point, check, and free
+static int check_aligned(int leak) {
+    void* ptrs[5] = {};
+    size_t aligns[5] = {64, 256, 4096, 4096, 4096};
+    if (posix_memalign(&ptrs[0], 64, 100) != 0) {
+        return 1;
+    }
+    ptrs[1] = aligned_alloc(256, 512);
+    ptrs[2] = memalign(4096, 100);
+    ptrs[3] = valloc(100);
+    ptrs[4] = pvalloc(100);
+    for(int i=0;i<5;i++) {
+        if (!ptrs[i] || reinterpret_cast<uintptr_t>(ptrs[i]) % aligns[i] != 0
+            || malloc_usable_size(ptrs[i]) < 100) {
+            return 2+i;
+        }
+    }
+    // realloc of an aligned block keeps its contents
+    static_cast<char*>(ptrs[0])[99] = 42;
+    ptrs[0] = realloc(ptrs[0], 200);
+    if (!ptrs[0] || static_cast<char*>(ptrs[0])[99] != 42) {
+        return 8;
+    }
+    for(int i=leak;i<5;i++) {
+        free(ptrs[i]);
+    }
+    return 0;
+}
+
+int main() {
+    memory::set_scope("main");
+    int ret = check_aligned(0);
+    if (ret) {
+        return ret;
+    }
+
+    // leak only the reallocated posix_memalign block
+    memory::set_scope("leak");
+    return check_aligned(1);
+}
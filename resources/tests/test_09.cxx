@@ -0,0 +1,69 @@
+#include <cstdio>
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("main");
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // 8 pages, then unmap two pages from the middle
+    char* ptr = static_cast<char*>(mmap(nullptr, 8*page, PROT_READ|PROT_WRITE,
+                                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+    if (ptr == MAP_FAILED) {
+        return 1;
+    }
+    if (munmap(ptr+2*page, 2*page) != 0) {
+        return 2;
+    }
+
+    // grow the first piece to 4 pages; it keeps its scope
+    memory::set_scope("other");
+    char* moved = static_cast<char*>(mremap(ptr, 2*page, 4*page, MREMAP_MAYMOVE));
+    if (moved == MAP_FAILED) {
+        return 3;
+    }
+
+    // unmap the last piece, leaving the 4 remapped pages
+    if (munmap(ptr+4*page, 4*page) != 0) {
+        return 4;
+    }
+
+    // an untracked mapping moved over a tracked one replaces it
+    memory::set_scope("main");
+    void* target = mmap(nullptr, 2*page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (target == MAP_FAILED) {
+        return 6;
+    }
+    memory::set_scope("");
+    void* source = mmap(nullptr, 2*page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (source == MAP_FAILED) {
+        return 7;
+    }
+    if (mremap(source, 2*page, 2*page, MREMAP_MAYMOVE|MREMAP_FIXED, target) != target) {
+        return 8;
+    }
+
+    // MREMAP_DONTUNMAP leaves the old range mapped, so both count
+    memory::set_scope("main");
+    void* kept = mmap(nullptr, page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (kept == MAP_FAILED) {
+        return 9;
+    }
+    if (mremap(kept, page, page, MREMAP_MAYMOVE|MREMAP_DONTUNMAP) == MAP_FAILED) {
+        if (errno != EINVAL) {
+            return 10;
+        }
+        printf("no MREMAP_DONTUNMAP\n"); // older kernels
+        fflush(stdout);
+    }
+
+    // mappings without a scope are not tracked
+    memory::set_scope("");
+    if (mmap(nullptr, page, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        return 5;
+    }
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+import os
+
+def verify(output):
+    pages = 5 if 'no MREMAP_DONTUNMAP' in output else 6
+    expected = {'main':str(pages*os.sysconf('SC_PAGESIZE'))}
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = size
+                continue
+            scopes = False
+        if line.startswith('Still mapped'):
+            scopes = True
+    if found != expected:
+        print("still mapped",found,"expected",expected)
+        raise Exception('wrong mapped memory')
@@ -0,0 +1,50 @@
+#include <new>
+#include <cstdint>
+#include "test.h"
+
+struct alignas(64) Block {
+    char data[256];
+};
+
+struct Counted {
+    ~Counted() { } // non-trivial, so delete[] passes the size
+    int value = 0;
+};
+
+int main() {
+    memory::set_scope("main");
+    char* volatile sink;
+
+    int* a = new int[25];
+    sink = reinterpret_cast<char*>(a);
+    delete[] a;
+
+    Counted* c = new Counted;
+    delete c;
+    Counted* cs = new Counted[10];
+    delete[] cs;
+
+    Block* b = new Block;
+    if (reinterpret_cast<uintptr_t>(b) % alignof(Block) != 0) {
+        return 1;
+    }
+    delete b;
+    Block* bs = new Block[2];
+    if (reinterpret_cast<uintptr_t>(bs) % alignof(Block) != 0) {
+        return 2;
+    }
+    delete[] bs;
+
+    char* n = new (std::nothrow) char[100];
+    if (!n) {
+        return 3;
+    }
+    delete[] n;
+
+    // leak an aligned block and a nothrow one
+    memory::set_scope("leak");
+    sink = (new Block)->data;
+    sink = new (std::nothrow) char[50];
+    (void)sink;
+    return 0;
+}
@@ -0,0 +1,15 @@
+def verify(output):
+    expected = {'leak':'306'}
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = size
+            continue
+        if line.startswith('Unfreed memory'):
+            scopes = True
+    if found != expected:
+        print("unfreed memory",found,"expected",expected)
+        raise Exception('wrong unfreed memory')
@@ -0,0 +1,18 @@
+#include <cstdlib>
+#include "test.h"
+
+int main() {
+    // lots of churn with a small live footprint
+    memory::set_scope("churn");
+    for(int i=0;i<1000;i++) {
+        volatile char* p = static_cast<char*>(malloc(100));
+        p[0] = 1;
+        free(const_cast<char*>(p));
+    }
+
+    // one large block left behind
+    memory::set_scope("big");
+    volatile char* big = static_cast<char*>(malloc(1<<20));
+    big[0] = 1;
+    return 0;
+}
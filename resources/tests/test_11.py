@@ -0,0 +1,32 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_11.out'}
+
+def verify(output):
+    # the series lines are written when a value changes, so the last
+    # line of each holds its final total
+    last = {}
+    with open(env['MEMSCOPETRACK_OUTFILE']) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('+'):
+                series,rest = line[1:].split(' ',1)
+                scope,value = rest.rsplit('|',1)
+                last[(series,scope)] = int(value)
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+
+    expected = {
+        ('allocs','churn'):1000,
+        ('frees','churn'):1000,
+        ('allocated','churn'):100000,
+        ('size6','churn'):1000,
+        ('allocs','big'):1,
+        ('allocated','big'):1<<20,
+        ('size20','big'):1,
+    }
+    for k in expected:
+        if last.get(k) != expected[k]:
+            print('series',k,'is',last.get(k),'expected',expected[k])
+            raise Exception('wrong allocation statistics')
+    if ('frees','big') in last:
+        raise Exception('unexpected free in scope big')
@@ -0,0 +1,20 @@
+#include <cstdlib>
+#include "test.h"
+
+int main() {
+    // a spike that is gone well before the next snapshot
+    memory::set_scope("spike");
+    volatile char* blocks[10];
+    for(int i=0;i<10;i++) {
+        blocks[i] = static_cast<char*>(malloc(1<<20));
+        blocks[i][0] = 1;
+    }
+    for(int i=0;i<10;i++) {
+        free(const_cast<char*>(blocks[i]));
+    }
+
+    memory::set_scope("main");
+    volatile char* p = static_cast<char*>(malloc(1000));
+    p[0] = 1;
+    return 0;
+}
@@ -0,0 +1,21 @@
+def verify(output):
+    expected = {'spike':str(10<<20), 'main':'1000'}
+    found = {}
+    total = None
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = size
+                continue
+            scopes = False
+        if line.startswith('Peak memory'):
+            total = int(line.split(':')[1])
+            scopes = True
+    if found != expected:
+        print("peak memory",found,"expected",expected)
+        raise Exception('wrong peak memory')
+    if total is None or total < 10<<20 or total > (10<<20)+1000:
+        print("total peak",total)
+        raise Exception('wrong total peak memory')
@@ -0,0 +1,12 @@
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("main");
+    volatile char* p = static_cast<char*>(malloc(100));
+    p[0] = 1;
+    usleep(500000);
+    free(const_cast<char*>(p));
+    return 0;
+}
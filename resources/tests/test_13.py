@@ -0,0 +1,12 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_13.out', 'MEMSCOPETRACK_INTERVAL':'20'}
+
+def verify(output):
+    with open(env['MEMSCOPETRACK_OUTFILE']) as f:
+        snapshots = sum(1 for line in f if line.startswith('---'))
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+    # 500ms at 20ms per snapshot, with plenty of slack for a loaded machine
+    if snapshots < 10:
+        print("snapshots",snapshots)
+        raise Exception('interval not applied')
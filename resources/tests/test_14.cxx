@@ -0,0 +1,17 @@
+#include <cstdlib>
+
+// no scope is ever set, so allocations are attributed to call stacks
+__attribute__((noinline)) void* allocate(size_t size) {
+    void* volatile ptr = malloc(size);
+    return ptr;
+}
+
+int main() {
+    // a volatile count, so that the loop is not unrolled into three call sites
+    volatile int count = 3;
+    for(int i=0;i<count;i++) {
+        allocate(100);
+    }
+    free(allocate(1000));
+    return 0;
+}
@@ -0,0 +1,17 @@
+env = {'MEMSCOPETRACK_STACKS':'3'}
+
+def verify(output):
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.rsplit(' - ',1)]
+                found[name] = int(size)
+            continue
+        if line.startswith('Unfreed memory'):
+            scopes = True
+    stacks = {k:v for k,v in found.items() if k.startswith('stack:') and 'test_14' in k}
+    if len(stacks) != 1 or list(stacks.values())[0] != 300:
+        print("unfreed memory",found)
+        raise Exception('wrong stack attribution')
@@ -0,0 +1,32 @@
+#include <cstdlib>
+#include "test.h"
+
+static void leak(size_t size) {
+    volatile char* p = static_cast<char*>(malloc(size));
+    p[0] = 1;
+}
+
+static void module() {
+    MEMORY_NESTED_SCOPE("module");
+    leak(100);
+}
+
+int main() {
+    memory::set_scope("pipeline");
+    leak(10);
+    {
+        MEMORY_NESTED_SCOPE("service");
+        leak(50);
+        module();
+        leak(5); // back in the service
+    }
+    leak(1); // back in the pipeline
+
+    // a path is the same node as the nested scope
+    memory::set_scope("pipeline/service/module");
+    leak(1000);
+
+    memory::set_scope("other");
+    leak(7);
+    return 0;
+}
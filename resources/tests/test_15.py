@@ -0,0 +1,38 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_15.out', 'MEMSCOPETRACK_DEPTH':'1'}
+
+def verify(output):
+    # the exit report has the leaves
+    expected = {'pipeline':'11', 'pipeline/service':'55',
+                'pipeline/service/module':'1100', 'other':'7'}
+    found = {}
+    scopes = False
+    for line in output.split('\n'):
+        if scopes:
+            if line.startswith('  '):
+                name,size = [x.strip() for x in line.split('-')]
+                found[name] = size
+            continue
+        if line.startswith('Unfreed memory'):
+            scopes = True
+    if found != expected:
+        print("unfreed memory",found,"expected",expected)
+        raise Exception('wrong unfreed memory')
+
+    # snapshots are rolled up to the top level
+    last = {}
+    with open(env['MEMSCOPETRACK_OUTFILE']) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('---'):
+                last = {}
+            elif not line.startswith('+'):
+                scope,value = line.rsplit('|',1)
+                last[scope] = int(value)
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+    expected = {'pipeline':1166, 'pipeline/service':0,
+                'pipeline/service/module':0, 'other':7}
+    if last != expected:
+        print("last snapshot",last,"expected",expected)
+        raise Exception('wrong rolled up snapshot')
@@ -0,0 +1,38 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "test.h"
+
+// read the live snapshot from our own query socket
+static int query(const char* path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        return 1;
+    }
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+int main() {
+    memory::set_scope("live");
+    volatile char* p = static_cast<char*>(malloc(1000));
+    p[0] = 1;
+    memory::set_scope("");
+    printf("query:\n");
+    int ret = query(getenv("MEMSCOPETRACK_SOCKET"));
+    printf("end query\n");
+    fflush(stdout);
+    free(const_cast<char*>(p));
+    return ret;
+}
@@ -0,0 +1,16 @@
+env = {'MEMSCOPETRACK_SOCKET':'test_16.sock'}
+
+def verify(output):
+    found = {}
+    in_query = False
+    for line in output.split('\n'):
+        if line.startswith('query:'):
+            in_query = True
+        elif line.startswith('end query'):
+            in_query = False
+        elif in_query and '|' in line and not line.startswith('+'):
+            scope,value = line.rsplit('|',1)
+            found[scope] = value
+    if found.get('live') != '1000':
+        print("live query",found)
+        raise Exception('wrong live query result')
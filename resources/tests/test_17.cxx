@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../../src/format.h"
+
+// read the heap bytes of a scope from the shared memory segment
+static long long read_scope(const char* segment, const char* scope) {
+    std::string path = std::string("/dev/shm/") + segment;
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return -1;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    const char* mem = static_cast<const char*>(base);
+    auto* h = reinterpret_cast<const format::ShmHeader*>(mem);
+    long long ret = -2;
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        ret = -2;
+        const char* names = mem + h->names_offset;
+        auto* values = reinterpret_cast<const format::ShmScope*>(mem + h->values_offset);
+        size_t pos = 0;
+        for (uint32_t id=1; id<h->scopes; id++) {
+            uint32_t length;
+            memcpy(&length, names+pos, sizeof(length));
+            if (std::string(names+pos+sizeof(length), length) == scope) {
+                ret = values[id].heap;
+            }
+            pos += sizeof(length) + length;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    munmap(base, st.st_size);
+    return ret;
+}
+
+int main() {
+    memory::set_scope("shm");
+    volatile char* p = static_cast<char*>(malloc(1234));
+    p[0] = 1;
+    memory::set_scope("");
+    usleep(200000); // a few snapshots
+    printf("shm heap %lld\n", read_scope(getenv("MEMSCOPETRACK_SHM"), "shm"));
+    fflush(stdout);
+    free(const_cast<char*>(p));
+    return 0;
+}
@@ -0,0 +1,12 @@
+import os
+
+env = {'MEMSCOPETRACK_SHM':'memscopetrack.test_17.%d'%os.getpid(),
+       'MEMSCOPETRACK_INTERVAL':'10', 'MEMSCOPETRACK_OUTFILE':'none'}
+
+def verify(output):
+    if 'shm heap 1234' not in output:
+        raise Exception('wrong shared memory value')
+    if 'timeline.py' in output:
+        raise Exception('timeline written with MEMSCOPETRACK_OUTFILE=none')
+    if os.path.exists('/dev/shm/'+env['MEMSCOPETRACK_SHM']):
+        raise Exception('segment not removed at exit')
@@ -0,0 +1,28 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <malloc.h>
+#include "test.h"
+
+// the tracker's own bookkeeping must not grow the application's heap
+int main() {
+    const int N = 100000;
+    static void* blocks[N];
+    memory::set_scope("small");
+    size_t before = mallinfo2().uordblks;
+    for(int i=0;i<N;i++) {
+        blocks[i] = malloc(16);
+    }
+    size_t after = mallinfo2().uordblks;
+    memory::set_scope("");
+    printf("heap per block %zu\n", (after - before) / N);
+
+    // blocks handed back from another thread
+    std::thread worker([](){
+        for(int i=0;i<N;i++) {
+            free(blocks[i]);
+        }
+    });
+    worker.join();
+    return 0;
+}
@@ -0,0 +1,16 @@
+def verify(output):
+    per_block = None
+    overhead = None
+    for line in output.split('\n'):
+        if line.startswith('heap per block'):
+            per_block = int(line.split()[-1])
+        elif line.startswith('Tracker overhead:'):
+            overhead = line
+    # glibc needs 32 bytes for a 16 byte block; tracker nodes would add more
+    if per_block is None or per_block > 32:
+        print("heap per block",per_block)
+        raise Exception('tracker allocations reached the heap')
+    if overhead is None:
+        raise Exception('no tracker overhead report')
+    if 'did not fit' in output:
+        raise Exception('tracker arena fell back to malloc')
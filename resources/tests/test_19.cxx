@@ -0,0 +1,21 @@
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("steady");
+    volatile char* steady = static_cast<char*>(malloc(1000));
+    steady[0] = 1;
+
+    // a spike that lasts a few snapshots
+    memory::set_scope("spike");
+    volatile char* spike = static_cast<char*>(malloc(1<<20));
+    spike[0] = 1;
+    usleep(200000);
+    free(const_cast<char*>(spike));
+    usleep(100000);
+
+    memory::set_scope("steady");
+    free(const_cast<char*>(steady));
+    return 0;
+}
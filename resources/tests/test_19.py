@@ -0,0 +1,54 @@
+import os
+import shutil
+import subprocess
+import tempfile
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_19.out', 'MEMSCOPETRACK_EVENTS':'test_19.events',
+       'MEMSCOPETRACK_INTERVAL':'10'}
+
+def report(*args):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),'..','memscopetrack-report')
+    report_env = dict(os.environ)
+    report_env.pop('LD_PRELOAD', None)
+    out = subprocess.check_output([path]+list(args), env=report_env, universal_newlines=True)
+    print(out)
+    # scope -> (peak, final)
+    rows = {}
+    for line in out.split('\n')[2:]:
+        if not line.startswith('  ') or line.startswith('  window'):
+            break
+        scope,peak,average,final = line.split()
+        rows[scope] = (int(peak),int(final))
+    return rows
+
+def verify(output):
+    tmp = tempfile.mkdtemp()
+    try:
+        expected = {'spike':(1<<20,0), 'steady':(1000,0)}
+        for filename in (env['MEMSCOPETRACK_OUTFILE'],env['MEMSCOPETRACK_EVENTS']):
+            rows = report('--csv', tmp, filename)
+            found = {k:rows.get(k) for k in expected}
+            if found != expected:
+                print('report of',filename,'is',found,'expected',expected)
+                raise Exception('wrong report')
+
+        # the conversion has every change of the spike
+        with open(os.path.join(tmp,env['MEMSCOPETRACK_EVENTS']+'.csv')) as f:
+            spike = [int(line.rsplit(',',1)[1]) for line in f if ',spike,' in line]
+        if spike != [1<<20,0]:
+            print('spike rows',spike)
+            raise Exception('wrong CSV conversion')
+
+        # inputs with the same name get their own CSV file
+        job = os.path.join(tmp,'job')
+        os.mkdir(job)
+        shutil.copy(env['MEMSCOPETRACK_EVENTS'], job)
+        report('--csv', tmp, env['MEMSCOPETRACK_EVENTS'], os.path.join(job,env['MEMSCOPETRACK_EVENTS']))
+        for n in (1,2):
+            if not os.path.exists(os.path.join(tmp,'%s.%d.csv'%(env['MEMSCOPETRACK_EVENTS'],n))):
+                print(os.listdir(tmp))
+                raise Exception('CSV files collide')
+    finally:
+        shutil.rmtree(tmp)
+        os.remove(env['MEMSCOPETRACK_OUTFILE'])
+        os.remove(env['MEMSCOPETRACK_EVENTS'])
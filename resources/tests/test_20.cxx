@@ -0,0 +1,13 @@
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("kept");
+    volatile char* p = static_cast<char*>(malloc(4096));
+    p[0] = 1;
+    usleep(500000);
+
+    // skip the exit handlers, as if the job was killed
+    _exit(0);
+}
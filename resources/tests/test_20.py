@@ -0,0 +1,27 @@
+import os
+import zlib
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_20.out.gz', 'MEMSCOPETRACK_FLUSH':'0.1',
+       'MEMSCOPETRACK_INTERVAL':'10', 'MEMSCOPETRACK_COMPRESSION':'1'}
+
+def verify(output):
+    with open(env['MEMSCOPETRACK_OUTFILE'],'rb') as f:
+        data = f.read()
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+
+    # complete gzip members, up to the one cut off at exit
+    text = b''
+    members = 0
+    while data:
+        d = zlib.decompressobj(16+zlib.MAX_WBITS)
+        text += d.decompress(data)
+        if not d.eof:
+            break
+        members += 1
+        data = d.unused_data
+    snapshots = text.count(b'---')
+    print('members',members,'snapshots',snapshots)
+    if members < 2 or snapshots < 10:
+        raise Exception('no readable trace from a process that did not exit')
+    if b'\nkept|4096\n' not in text:
+        raise Exception('scope missing from the flushed trace')
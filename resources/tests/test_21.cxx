@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "test.h"
+
+int main() {
+    printf("main thread %ld\n", syscall(SYS_gettid));
+    memory::set_scope("work");
+    volatile char* kept = static_cast<char*>(malloc(1000));
+    kept[0] = 1;
+    // starting the thread allocates too
+    memory::set_scope("other");
+
+    // the worker keeps one block, and hands another one back to be freed here
+    volatile char* worker_kept = nullptr;
+    volatile char* handed = nullptr;
+    std::thread worker([&](){
+        printf("worker thread %ld\n", syscall(SYS_gettid));
+        memory::set_scope("work");
+        worker_kept = static_cast<char*>(malloc(3000));
+        handed = static_cast<char*>(malloc(5000));
+    });
+    worker.join();
+    free(const_cast<char*>(handed));
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,34 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_21.out', 'MEMSCOPETRACK_BREAKDOWN':'thread,node'}
+
+def verify(output):
+    threads = {}
+    for line in output.split('\n'):
+        parts = line.split()
+        if len(parts) == 3 and parts[0] in ('main','worker') and parts[1] == 'thread':
+            threads[parts[0]] = 'thread'+parts[2]
+
+    # the series lines are written when a value changes, so the last
+    # line of each holds the final breakdown
+    last = {}
+    with open(env['MEMSCOPETRACK_OUTFILE']) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('+'):
+                series,rest = line[1:].split(' ',1)
+                scope,value = rest.rsplit('|',1)
+                last[(series,scope)] = int(value)
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+
+    # the block freed by main is taken off the worker
+    found = {k:last.get((threads[k],'work')) for k in ('main','worker')}
+    expected = {'main':1000, 'worker':3000}
+    if found != expected:
+        print('threads',threads,'breakdown',found,'expected',expected)
+        raise Exception('wrong per-thread breakdown')
+    nodes = sum(v for (series,scope),v in last.items()
+                if series.startswith('node') and scope == 'work')
+    if nodes != 4000:
+        print('per-node total',nodes)
+        raise Exception('wrong per-node breakdown')
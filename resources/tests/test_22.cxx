@@ -0,0 +1,42 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "test.h"
+
+static void over(const char* scope, size_t bytes, size_t budget, void* arg)
+{
+    // allocating in the callback is fine, and does not call it again
+    std::string message = std::string("over budget ") + scope;
+    printf("%s %zu %zu %d\n", message.c_str(), bytes, budget, *static_cast<int*>(arg));
+}
+
+int main() {
+    int round = 1;
+    memory::set_scope_budget("cache", 100000, over, &round);
+
+    memory::set_scope("cache");
+    std::vector<void*> blocks;
+    for(int i=0;i<10;i++) {
+        blocks.push_back(malloc(20000));
+    }
+    // back under the budget, and over it again
+    for(void* p : blocks) {
+        free(p);
+    }
+    round = 2;
+    for(int i=0;i<10;i++) {
+        blocks[i] = malloc(20000);
+    }
+    for(void* p : blocks) {
+        free(p);
+    }
+
+    // from MEMSCOPETRACK_BUDGETS, logged
+    memory::set_scope("env");
+    void* volatile p = malloc(5000);
+    free(p);
+    memory::set_scope("");
+    fflush(stdout);
+    return 0;
+}
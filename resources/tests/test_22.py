@@ -0,0 +1,20 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_22.out', 'MEMSCOPETRACK_BUDGETS':'env=4K, cache=1M'}
+
+def verify(output):
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+    calls = [line.split() for line in output.split('\n') if line.startswith('over budget ')]
+    # once per crossing, and set_scope_budget replaces the limit from
+    # the environment; the vector and stdout buffer are in the scope too
+    rounds = [c[5] for c in calls]
+    if rounds != ['1','2'] or any(c[2] != 'cache' or c[4] != '100000' for c in calls):
+        print('callbacks',calls)
+        raise Exception('wrong budget callbacks')
+    if any(not 100000 < int(c[3]) <= 130000 for c in calls):
+        print('callbacks',calls)
+        raise Exception('wrong bytes over budget')
+    if 'scope env is over its budget: 5000 of 4096 bytes' not in output:
+        raise Exception('no budget warning')
+    if '  cache - 2 times over 100000 bytes' not in output or '  env - 1 times over 4096 bytes' not in output:
+        raise Exception('missing exit report')
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "test.h"
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "exec") == 0) {
+        // exec'd child, tracked with MEMSCOPETRACK_FOLLOW_EXEC
+        printf("exec pid %d\n", static_cast<int>(getpid()));
+        memory::set_scope("exec");
+        volatile char* kept = static_cast<char*>(malloc(3000));
+        kept[0] = 1;
+        fflush(stdout);
+        return 0;
+    }
+
+    printf("parent pid %d\n", static_cast<int>(getpid()));
+    memory::set_scope("shared");
+    volatile char* shared = static_cast<char*>(malloc(500));
+    shared[0] = 1;
+    char* volatile inherited = static_cast<char*>(malloc(700));
+
+    // keep the tracker busy in another thread while forking
+    memory::set_scope("");
+    std::atomic<bool> running(true);
+    std::thread busy([&](){
+        memory::set_scope("busy");
+        while (running) {
+            free(malloc(64));
+        }
+    });
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        printf("child pid %d\n", static_cast<int>(getpid()));
+        free(inherited);
+        memory::set_scope("child");
+        volatile char* kept = static_cast<char*>(malloc(2000));
+        kept[0] = 1;
+        fflush(stdout);
+        exit(0);
+    }
+
+    pid_t execd = fork();
+    if (execd == 0) {
+        execl("/proc/self/exe", argv[0], "exec", static_cast<char*>(nullptr));
+        _exit(1);
+    }
+
+    int status;
+    waitpid(child, &status, 0);
+    waitpid(execd, &status, 0);
+    running = false;
+    busy.join();
+
+    memory::set_scope("parent");
+    volatile char* kept = static_cast<char*>(malloc(1000));
+    kept[0] = 1;
+    return 0;
+}
@@ -0,0 +1,44 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_23.out', 'MEMSCOPETRACK_FOLLOW_EXEC':'1'}
+
+def last_snapshot(filename):
+    last = {}
+    with open(filename) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('---'):
+                last = {}
+            elif line and not line.startswith('+'):
+                scope,value = line.rsplit('|',1)
+                last[scope] = int(value)
+    os.remove(filename)
+    return last
+
+def verify(output):
+    pids = {}
+    for line in output.split('\n'):
+        parts = line.split()
+        if len(parts) == 3 and parts[1] == 'pid':
+            pids[parts[0]] = parts[2]
+    if sorted(pids) != ['child','exec','parent']:
+        raise Exception('missing process output')
+
+    # each process writes its own file, and a forked child starts from
+    # what it inherited
+    files = {'parent':env['MEMSCOPETRACK_OUTFILE'],
+             'child':env['MEMSCOPETRACK_OUTFILE']+'.'+pids['child'],
+             'exec':env['MEMSCOPETRACK_OUTFILE']+'.'+pids['exec']}
+    expected = {'parent':{'shared':500,'parent':1000},
+                'child':{'shared':500,'child':2000},
+                'exec':{'exec':3000}}
+    for name,filename in files.items():
+        if not os.path.exists(filename):
+            raise Exception('no output file for the '+name)
+        found = {k:v for k,v in last_snapshot(filename).items() if v and k != 'busy'}
+        if name == 'parent':
+            # not freed in the parent
+            expected[name]['shared'] += 700
+        if found != expected[name]:
+            print(name,'found',found,'expected',expected[name])
+            raise Exception('wrong timeline for the '+name)
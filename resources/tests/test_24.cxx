@@ -0,0 +1,28 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("old");
+    for(int i=0;i<10;i++) {
+        volatile char* p = static_cast<char*>(malloc(1000));
+        p[0] = 1;
+    }
+    // long enough for the snapshot thread to move the clock on
+    usleep(1500000);
+
+    memory::set_scope("young");
+    for(int i=0;i<3;i++) {
+        volatile char* p = static_cast<char*>(malloc(100000));
+        p[0] = 1;
+    }
+    for(int i=0;i<5;i++) {
+        volatile char* p = static_cast<char*>(malloc(16));
+        p[0] = 1;
+    }
+    char* freed = static_cast<char*>(malloc(50000));
+    free(freed);
+    memory::set_scope("");
+    return 0;
+}
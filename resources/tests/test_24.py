@@ -0,0 +1,23 @@
+import os
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_24.out', 'MEMSCOPETRACK_LEAKS':'2'}
+
+def verify(output):
+    os.remove(env['MEMSCOPETRACK_OUTFILE'])
+    lines = output.split('\n')
+    start = [i for i,line in enumerate(lines) if line.startswith('Unfreed blocks:')]
+    if len(start) != 1:
+        raise Exception('no leak report')
+    report = lines[start[0]:start[0]+4]
+    print('report',report)
+
+    total = report[0]
+    if 'Unfreed blocks: 310080 bytes in 18 blocks' not in total:
+        raise Exception('wrong leak total')
+    # the largest groups first, with their ages; the rest only counted
+    if not report[1].startswith('  young size16 - 300000 bytes in 3 blocks; by age: 3 <1s, 0 <10s'):
+        raise Exception('wrong largest group')
+    if not report[2].startswith('  old size9 - 10000 bytes in 10 blocks; by age: 0 <1s, 10 <10s'):
+        raise Exception('wrong second group')
+    if report[3] != '  (1 more)':
+        raise Exception('groups beyond the limit not counted')
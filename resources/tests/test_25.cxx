@@ -0,0 +1,13 @@
+#include <cstdio>
+#include <cstdlib>
+#include "test.h"
+
+int main() {
+    memory::set_scope("kept");
+    volatile char* p = static_cast<char*>(malloc(1000));
+    p[0] = 1;
+    memory::set_scope("");
+    printf("done\n");
+    fflush(stdout);
+    return 0;
+}
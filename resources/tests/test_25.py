@@ -0,0 +1,15 @@
+env = {'MEMSCOPETRACK_OUTFILE':'/nonexistent/test_25.out.gz',
+       'MEMSCOPETRACK_EVENTS':'/nonexistent/test_25.events',
+       'MEMSCOPETRACK_LOGFILE':'/nonexistent/test_25.log'}
+
+def verify(output):
+    # output files that cannot be opened are reported, not fatal
+    if 'done' not in output.split('\n'):
+        raise Exception('program did not run to completion')
+    for name in env.values():
+        if 'cannot open '+name in output:
+            continue
+        raise Exception('no error for '+name)
+    # the log falls back to stderr
+    if 'Unfreed memory:' not in output or '  kept - 1000' not in output:
+        raise Exception('no exit report')
@@ -0,0 +1,19 @@
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    // nested scopes, rolled up by timeline.py --depth 1
+    memory::set_scope("job/a");
+    volatile char* a = static_cast<char*>(malloc(1000));
+    a[0] = 1;
+    memory::set_scope("job/b");
+    volatile char* b = static_cast<char*>(malloc(2000));
+    b[0] = 1;
+    memory::set_scope("");
+    usleep(100000);
+
+    free(const_cast<char*>(a));
+    free(const_cast<char*>(b));
+    return 0;
+}
@@ -0,0 +1,60 @@
+import os
+import sys
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),'..','python'))
+import timeline
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_26.out', 'MEMSCOPETRACK_INTERVAL':'10'}
+
+def synthetic(snapshots):
+    # 10 ms snapshots: a steady scope, a spike in a single snapshot, and
+    # a running total of one per snapshot
+    for i in range(snapshots):
+        yield (i/100.0, {'steady':1.0, 'spike':50.0 if i == 12345 else 0.0, 'total':float(i)})
+
+def verify(output):
+    try:
+        # the readers and the Downsampler work without matplotlib
+        points = 100
+        d = timeline.Downsampler(points=points)
+        for t,data in synthetic(20000):
+            d.add(t, data)
+        if len(d.times) > points or any(len(v) > points for v in d.series.values()):
+            print('buckets',len(d.times),{k:len(v) for k,v in d.series.items()})
+            raise Exception('too many buckets')
+        spike = d.get('spike')
+        if d.peaks['spike'] != 50.0 or max(spike['values']) != 50.0:
+            print('spike',d.peaks['spike'],max(spike['values']))
+            raise Exception('spike lost in downsampling')
+        if spike['times'] != sorted(spike['times']) or spike['times'][0] != 0.0:
+            print('times',spike['times'])
+            raise Exception('wrong bucket times')
+        if d.top(2) != ['total','spike']:
+            print('top',d.top(2))
+            raise Exception('wrong top scopes')
+
+        # --rate turns the running total into 100 per second
+        d = timeline.Downsampler(points=points)
+        for t,data in timeline.iter_rates(synthetic(1000)):
+            d.add(t, data)
+        rate = d.get('total')['values']
+        if len(rate) > points or any(abs(v-100.0) > 1e-6 for v in rate):
+            print('rate',rate)
+            raise Exception('wrong rate')
+
+        # --depth 1 on a real timeline
+        d = timeline.Downsampler(points=points)
+        for t,data in timeline.iter_rollup(timeline.iter_data(env['MEMSCOPETRACK_OUTFILE']), 1):
+            d.add(t, data)
+        if d.top() != ['job'] or abs(d.peaks['job']-0.003) > 1e-9:
+            print('rolled up',d.peaks)
+            raise Exception('wrong rollup')
+
+        try:
+            import matplotlib
+        except ImportError:
+            return # nothing to plot with
+        timeline.graph_downsampled(d, 'test_26.png', ylabel='Memory (MB)')
+        os.remove('test_26.png')
+    finally:
+        os.remove(env['MEMSCOPETRACK_OUTFILE'])
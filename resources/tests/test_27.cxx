@@ -0,0 +1,22 @@
+#include <cstdlib>
+#include <unistd.h>
+#include "test.h"
+
+int main() {
+    memory::set_scope("a");
+    volatile char* a = static_cast<char*>(malloc(1000));
+    a[0] = 1;
+    memory::set_scope("b");
+    for(int i=0;i<5;i++) {
+        volatile char* b = static_cast<char*>(malloc(2000));
+        b[0] = 1;
+    }
+    memory::set_scope("");
+    usleep(100000);
+
+    memory::set_scope("a");
+    free(const_cast<char*>(a));
+    memory::set_scope("");
+    usleep(50000);
+    return 0;
+}
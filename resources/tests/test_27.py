@@ -0,0 +1,67 @@
+import os
+import subprocess
+import sys
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),'..','python'))
+import timeline
+
+env = {'MEMSCOPETRACK_OUTFILE':'test_27.out', 'MEMSCOPETRACK_FORMAT':'binary',
+       'MEMSCOPETRACK_INTERVAL':'10'}
+
+def report(*args):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),'..','memscopetrack-report')
+    report_env = dict(os.environ)
+    report_env.pop('LD_PRELOAD', None)
+    out = subprocess.check_output([path]+list(args), env=report_env, universal_newlines=True)
+    print(out)
+    # scope -> (peak, final)
+    rows = {}
+    for line in out.split('\n')[2:]:
+        if not line.startswith('  '):
+            break
+        scope,peak,average,final = line.split()
+        rows[scope] = (int(peak),int(final))
+    return out.split('\n')[0],rows
+
+def check(name, found, expected):
+    found = {k:found.get(k) for k in expected}
+    if found != expected:
+        print(name,'is',found,'expected',expected)
+        raise Exception('wrong '+name)
+
+def verify(output):
+    filename = env['MEMSCOPETRACK_OUTFILE']
+    truncated = filename+'.truncated'
+    try:
+        with open(filename,'rb') as f:
+            data = f.read()
+        if not data.startswith(b'MSTB'):
+            raise Exception('not a binary timeline')
+
+        # heap from the TICK records, allocs from the SERIES records
+        header,rows = report('--series', 'heap', filename)
+        check('heap report', rows, {'a':(1000,0), 'b':(10000,10000)})
+        header,rows = report('--series', 'allocs', filename)
+        check('allocs report', rows, {'a':(1,1), 'b':(5,5)})
+
+        snapshots = timeline.import_data(filename)
+        check('heap timeline', snapshots[-1][1], {'a':0.0, 'b':0.01})
+        if max(data.get('a',0) for t,data in snapshots) != 0.001:
+            raise Exception('heap timeline misses a')
+        snapshots = timeline.import_data(filename, series='allocs')
+        check('allocs timeline', snapshots[-1][1], {'a':1, 'b':5})
+
+        # a job that did not exit cleanly leaves a partial last record,
+        # here a snapshot cut off within its time delta
+        with open(truncated,'wb') as f:
+            f.write(data+b'T\x85')
+        header,rows = report('--series', 'allocs', truncated)
+        if not header.endswith('(truncated)'):
+            raise Exception('truncation not reported')
+        check('truncated allocs report', rows, {'a':(1,1), 'b':(5,5)})
+        snapshots = timeline.import_data(truncated, series='allocs')
+        check('truncated allocs timeline', snapshots[-1][1], {'a':1, 'b':5})
+    finally:
+        os.remove(filename)
+        if os.path.exists(truncated):
+            os.remove(truncated)
@@ -0,0 +1,538 @@
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "arena.h"
+#include "track.h"
+
+namespace arena {
+    namespace detail {
+        char* base = nullptr;
+        char* end = nullptr;
+    }
+
+    namespace {
+        constexpr size_t SLAB_SHIFT = 16;
+        constexpr size_t SLAB = size_t(1) << SLAB_SHIFT;    // 64KB
+        constexpr size_t COMMIT = 16 * SLAB;    // committed 1MB at a time
+        constexpr size_t ALIGNMENT = 16;        // what malloc guarantees
+        constexpr size_t MAX_SMALL = 32768;     // largest size class
+        constexpr size_t CLASSES = 40;
+
+        // default reservation, in MB (MEMSCOPETRACK_ARENA)
+        constexpr size_t DEFAULT_LIMIT = 65536;
+
+        // what a slab holds, besides a size class + 1
+        constexpr uint8_t SLAB_FREE = 0;
+        constexpr uint8_t RUN_HEAD = 0xfe;
+        constexpr uint8_t RUN_TAIL = 0xff;
+
+        // size class of 1 to MAX_SMALL bytes: steps of 16 up to 128, then
+        // four steps per doubling, so at most 25% is lost to rounding
+        inline size_t size_class(size_t size) noexcept
+        {
+            if (size <= 128) {
+                return size == 0 ? 0 : (size - 1) >> 4;
+            }
+            size_t log = 63 - __builtin_clzll(size - 1);
+            return 8 + (log - 7) * 4 + (((size - 1) >> (log - 2)) & 3);
+        }
+
+        inline size_t class_size(size_t c) noexcept
+        {
+            if (c < 8) {
+                return (c + 1) << 4;
+            }
+            size_t log = (c - 8) / 4 + 7;
+            return (5 + (c - 8) % 4) << (log - 2);
+        }
+
+        // blocks moved between a thread and the shared list at a time;
+        // a thread caches at most twice this many per class
+        inline size_t batch(size_t c) noexcept
+        {
+            return std::clamp<size_t>(8192 / class_size(c), 1, 32);
+        }
+
+        struct Node
+        {
+            Node* next;
+        };
+
+        // a freed run of slabs, stored in its own first bytes
+        struct FreeRun
+        {
+            FreeRun* next;
+            size_t slabs;
+        };
+
+        struct Class
+        {
+            std::mutex lock;
+            Node* free = nullptr;       // blocks given back
+            char* bump = nullptr;       // rest of the newest slab
+            char* bump_end = nullptr;
+        };
+        Class classes[CLASSES];
+
+        std::mutex slab_lock;
+        char* next_slab = nullptr;      // start of the never used range
+        char* committed_end = nullptr;
+        FreeRun* free_runs = nullptr;
+
+        // per slab: SLAB_FREE, RUN_HEAD, RUN_TAIL, or its size class + 1
+        uint8_t* slab_class = nullptr;
+        // per slab of a run: its length in slabs for the head,
+        // the distance back to the head for the rest
+        uint32_t* slab_run = nullptr;
+
+        size_t page_size = 4096;
+
+        std::atomic<size_t> committed{0};
+        std::atomic<size_t> in_use{0};
+        std::atomic<size_t> fallback{0};
+
+        enum State { UNINITIALIZED, READY, FAILED };
+        std::atomic<int> state{UNINITIALIZED};
+        std::mutex init_lock;
+
+        // straight to the kernel: the mmap overload would track the
+        // mapping, and may not even be set up yet
+        void* map(size_t length, int prot) noexcept
+        {
+            long ret = syscall(SYS_mmap, nullptr, length, prot,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            return ret == -1 ? nullptr : reinterpret_cast<void*>(ret);
+        }
+
+        // reserve the address range, once
+        bool reserve() noexcept
+        {
+            std::lock_guard<std::mutex> lock(init_lock);
+            int s = state.load(std::memory_order_relaxed);
+            if (s != UNINITIALIZED) {
+                return s == READY;
+            }
+
+            size_t limit = DEFAULT_LIMIT;
+            char* env = std::getenv("MEMSCOPETRACK_ARENA");
+            if (env != nullptr && strtoull(env, nullptr, 10) > 0) {
+                limit = strtoull(env, nullptr, 10);
+            }
+            limit <<= 20;
+
+            // take less address space where there is not that much
+            void* range = nullptr;
+            for(; limit >= COMMIT; limit /= 2) {
+                range = map(limit + SLAB, PROT_NONE);
+                if (range != nullptr) {
+                    break;
+                }
+            }
+            size_t slabs = limit >> SLAB_SHIFT;
+            void* meta = range ? map(slabs * (sizeof(uint32_t) + 1), PROT_READ | PROT_WRITE) : nullptr;
+            if (meta == nullptr) {
+                state.store(FAILED, std::memory_order_release);
+                return false;
+            }
+            slab_run = static_cast<uint32_t*>(meta);
+            slab_class = reinterpret_cast<uint8_t*>(slab_run + slabs);
+            page_size = sysconf(_SC_PAGESIZE);
+
+            // slabs are aligned, so a block finds its slab by masking
+            uintptr_t start = (reinterpret_cast<uintptr_t>(range) + SLAB - 1) & ~(SLAB - 1);
+            detail::base = reinterpret_cast<char*>(start);
+            detail::end = detail::base + limit;
+            next_slab = committed_end = detail::base;
+            state.store(READY, std::memory_order_release);
+            return true;
+        }
+
+        inline bool ready() noexcept
+        {
+            return state.load(std::memory_order_acquire) == READY || reserve();
+        }
+
+        inline size_t slab_index(const void* ptr) noexcept
+        {
+            return static_cast<size_t>(static_cast<const char*>(ptr) - detail::base) >> SLAB_SHIFT;
+        }
+
+        inline char* slab_start(size_t index) noexcept
+        {
+            return detail::base + (index << SLAB_SHIFT);
+        }
+
+        // n adjacent slabs, from a freed run or the unused range;
+        // slab_lock held
+        char* take_slabs(size_t n) noexcept
+        {
+            for(FreeRun** p = &free_runs; *p != nullptr; p = &(*p)->next) {
+                FreeRun* run = *p;
+                if (run->slabs == n) {
+                    *p = run->next;
+                    return reinterpret_cast<char*>(run);
+                }
+                if (run->slabs > n) {
+                    run->slabs -= n;
+                    return reinterpret_cast<char*>(run) + (run->slabs << SLAB_SHIFT);
+                }
+            }
+            if (n > static_cast<size_t>(detail::end - next_slab) >> SLAB_SHIFT) {
+                return nullptr;
+            }
+            char* ret = next_slab;
+            char* used = next_slab + (n << SLAB_SHIFT);
+            if (used > committed_end) {
+                size_t length = (used - committed_end + COMMIT - 1) & ~(COMMIT - 1);
+                length = std::min<size_t>(length, detail::end - committed_end);
+                if (mprotect(committed_end, length, PROT_READ | PROT_WRITE) != 0) {
+                    return nullptr;
+                }
+                committed_end += length;
+                committed.fetch_add(length, std::memory_order_relaxed);
+            }
+            next_slab = used;
+            return ret;
+        }
+
+        void* allocate_run(size_t size) noexcept
+        {
+            if (size > static_cast<size_t>(detail::end - detail::base)) {
+                return nullptr;
+            }
+            size_t n = (size + SLAB - 1) >> SLAB_SHIFT;
+            char* run;
+            {
+                std::lock_guard<std::mutex> lock(slab_lock);
+                run = take_slabs(n);
+            }
+            if (run == nullptr) {
+                return nullptr;
+            }
+            size_t head = slab_index(run);
+            slab_class[head] = RUN_HEAD;
+            slab_run[head] = static_cast<uint32_t>(n);
+            for(size_t i=1;i<n;i++) {
+                slab_class[head+i] = RUN_TAIL;
+                slab_run[head+i] = static_cast<uint32_t>(i);
+            }
+            in_use.fetch_add(n << SLAB_SHIFT, std::memory_order_relaxed);
+            return run;
+        }
+
+        void deallocate_run(size_t head) noexcept
+        {
+            size_t n = slab_run[head];
+            for(size_t i=0;i<n;i++) {
+                slab_class[head+i] = SLAB_FREE;
+            }
+            // give the memory back, keeping the page the list lives in
+            FreeRun* run = reinterpret_cast<FreeRun*>(slab_start(head));
+            madvise(reinterpret_cast<char*>(run) + page_size,
+                    (n << SLAB_SHIFT) - page_size, MADV_DONTNEED);
+            run->slabs = n;
+            in_use.fetch_sub(n << SLAB_SHIFT, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(slab_lock);
+            run->next = free_runs;
+            free_runs = run;
+        }
+
+        // a block of class c from the shared list or a slab; class lock held
+        Node* take(Class& k, size_t c) noexcept
+        {
+            if (k.free != nullptr) {
+                Node* n = k.free;
+                k.free = n->next;
+                return n;
+            }
+            size_t size = class_size(c);
+            if (static_cast<size_t>(k.bump_end - k.bump) < size) {
+                char* slab;
+                {
+                    std::lock_guard<std::mutex> lock(slab_lock);
+                    slab = take_slabs(1);
+                }
+                if (slab == nullptr) {
+                    return nullptr;
+                }
+                slab_class[slab_index(slab)] = static_cast<uint8_t>(c + 1);
+                k.bump = slab;
+                k.bump_end = slab + SLAB;
+            }
+            Node* n = reinterpret_cast<Node*>(k.bump);
+            k.bump += size;
+            return n;
+        }
+
+        // per-thread free lists; plain data, so using them sets up nothing
+        struct Cache
+        {
+            Node* head[CLASSES];
+            uint32_t count[CLASSES];
+            enum { NONE, REGISTERING, ACTIVE, EXITED } state;
+        };
+        thread_local Cache cache;
+
+        // move the first count blocks of a thread's list to the shared one
+        void give_back(Cache& t, size_t c, size_t count) noexcept
+        {
+            if (count == 0) {
+                return;
+            }
+            Node* first = t.head[c];
+            Node* last = first;
+            for(size_t i=1;i<count;i++) {
+                last = last->next;
+            }
+            t.head[c] = last->next;
+            t.count[c] -= static_cast<uint32_t>(count);
+            Class& k = classes[c];
+            {
+                std::lock_guard<std::mutex> lock(k.lock);
+                last->next = k.free;
+                k.free = first;
+            }
+            in_use.fetch_sub(count * class_size(c), std::memory_order_relaxed);
+        }
+
+        struct ThreadExit
+        {
+            ~ThreadExit()
+            {
+                for(size_t c=0;c<CLASSES;c++) {
+                    give_back(cache, c, cache.count[c]);
+                }
+                cache.state = Cache::EXITED;
+            }
+        };
+
+        // the calling thread's cache, or nullptr to use the shared lists.
+        // Only threads running tracker code get one, as it takes a thread
+        // exit hook to hand the blocks back.
+        inline Cache* local() noexcept
+        {
+            Cache& t = cache;
+            if (t.state == Cache::ACTIVE) {
+                return &t;
+            }
+            if (t.state != Cache::NONE || !memory::context.in_tracker) {
+                return nullptr;
+            }
+            t.state = Cache::REGISTERING; // the hook allocates, from the shared lists
+            static thread_local ThreadExit hook;
+            (void)hook;
+            t.state = Cache::ACTIVE;
+            return &t;
+        }
+
+        void refill(Cache& t, size_t c) noexcept
+        {
+            size_t want = batch(c);
+            size_t got = 0;
+            Class& k = classes[c];
+            {
+                std::lock_guard<std::mutex> lock(k.lock);
+                for(; got<want; got++) {
+                    Node* n = take(k, c);
+                    if (n == nullptr) {
+                        break;
+                    }
+                    n->next = t.head[c];
+                    t.head[c] = n;
+                }
+            }
+            t.count[c] += static_cast<uint32_t>(got);
+            in_use.fetch_add(got * class_size(c), std::memory_order_relaxed);
+        }
+
+        void* allocate_small(size_t size) noexcept
+        {
+            size_t c = size_class(size);
+            Cache* t = local();
+            if (t != nullptr) {
+                if (t->head[c] == nullptr) {
+                    refill(*t, c);
+                }
+                Node* n = t->head[c];
+                if (n != nullptr) {
+                    t->head[c] = n->next;
+                    t->count[c]--;
+                }
+                return n;
+            }
+            Class& k = classes[c];
+            Node* n;
+            {
+                std::lock_guard<std::mutex> lock(k.lock);
+                n = take(k, c);
+            }
+            if (n != nullptr) {
+                in_use.fetch_add(class_size(c), std::memory_order_relaxed);
+            }
+            return n;
+        }
+
+        // start of the block holding ptr, which may point inside it
+        // when it came from allocate_aligned
+        inline char* block_start(const void* ptr, size_t index, size_t size) noexcept
+        {
+            char* slab = slab_start(index);
+            return slab + static_cast<size_t>(static_cast<const char*>(ptr) - slab) / size * size;
+        }
+    }
+
+    void* allocate(size_t size) noexcept
+    {
+        void* ptr = nullptr;
+        if (ready()) {
+            ptr = size <= MAX_SMALL ? allocate_small(size) : allocate_run(size);
+        }
+        if (ptr == nullptr) {
+            fallback.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ptr;
+    }
+
+    void* allocate_zeroed(size_t size) noexcept
+    {
+        void* ptr = allocate(size);
+        if (ptr != nullptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    void* allocate_aligned(size_t alignment, size_t size) noexcept
+    {
+        if (alignment <= ALIGNMENT) {
+            return allocate(size);
+        }
+        // like memalign, round the alignment up to a power of two
+        size_t a = ALIGNMENT;
+        while (a < alignment && a < SLAB) {
+            a <<= 1;
+        }
+        size_t total;
+        if (a < alignment || __builtin_add_overflow(size, a - ALIGNMENT, &total)) {
+            fallback.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        void* ptr = allocate(total);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(ptr) + a - 1) & ~(a - 1);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    void deallocate(void* ptr) noexcept
+    {
+        size_t index = slab_index(ptr);
+        uint8_t kind = slab_class[index];
+        if (kind == RUN_TAIL) {
+            index -= slab_run[index];
+            kind = slab_class[index];
+        }
+        if (kind == RUN_HEAD) {
+            deallocate_run(index);
+            return;
+        }
+        if (kind == SLAB_FREE) {
+            return; // not handed out, e.g. freed twice
+        }
+        size_t c = kind - 1;
+        Node* n = reinterpret_cast<Node*>(block_start(ptr, index, class_size(c)));
+        Cache* t = local();
+        if (t != nullptr) {
+            n->next = t->head[c];
+            t->head[c] = n;
+            if (++t->count[c] > 2 * batch(c)) {
+                give_back(*t, c, batch(c));
+            }
+            return;
+        }
+        Class& k = classes[c];
+        {
+            std::lock_guard<std::mutex> lock(k.lock);
+            n->next = k.free;
+            k.free = n;
+        }
+        in_use.fetch_sub(class_size(c), std::memory_order_relaxed);
+    }
+
+    void* reallocate(void* ptr, size_t size) noexcept
+    {
+        if (size == 0) {
+            deallocate(ptr);
+            return nullptr;
+        }
+        size_t old_size = usable_size(ptr);
+        if (size <= old_size) {
+            return ptr;
+        }
+        void* out_ptr = allocate(size);
+        if (out_ptr != nullptr) {
+            memcpy(out_ptr, ptr, old_size);
+            deallocate(ptr);
+        }
+        return out_ptr;
+    }
+
+    size_t usable_size(const void* ptr) noexcept
+    {
+        size_t index = slab_index(ptr);
+        uint8_t kind = slab_class[index];
+        if (kind == RUN_TAIL) {
+            index -= slab_run[index];
+            kind = slab_class[index];
+        }
+        const char* end;
+        if (kind == RUN_HEAD) {
+            end = slab_start(index) + (static_cast<size_t>(slab_run[index]) << SLAB_SHIFT);
+        } else if (kind != SLAB_FREE) {
+            size_t size = class_size(kind - 1);
+            end = block_start(ptr, index, size) + size;
+        } else {
+            return 0;
+        }
+        return end - static_cast<const char*>(ptr);
+    }
+
+    Stats stats() noexcept
+    {
+        Stats s;
+        s.reserved = detail::end - detail::base;
+        s.committed = committed.load(std::memory_order_relaxed);
+        s.in_use = in_use.load(std::memory_order_relaxed);
+        s.fallback = fallback.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void lock() noexcept
+    {
+        // in the order they nest: a class lock is held while taking
+        // the slab lock
+        init_lock.lock();
+        for(auto& k : classes) {
+            k.lock.lock();
+        }
+        slab_lock.lock();
+    }
+
+    void unlock() noexcept
+    {
+        slab_lock.unlock();
+        for(auto& k : classes) {
+            k.lock.unlock();
+        }
+        init_lock.unlock();
+    }
+}
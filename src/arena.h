@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Private allocator for the tracker's own memory.
+ *
+ * Everything the tracker allocates while it is running (address table
+ * nodes, scope names, snapshot copies, thread and stream buffers), i.e.
+ * with memory::context.in_tracker set, comes from here instead of the
+ * application's malloc, so the tracked heap only holds application
+ * memory.
+ *
+ * Memory is carved out of one reserved address range, committed in 64KB
+ * slabs as needed. A slab holds blocks of a single size class, and
+ * each thread keeps a short free list per class, so most allocations
+ * take no lock. A thread hands its blocks back to the shared lists when
+ * it exits. Blocks larger than the biggest class are runs of whole
+ * slabs. The address range never moves and is never unmapped, so a
+ * block can be recognized by its address alone, and freed by any
+ * thread at any time.
+ */
+namespace arena {
+    namespace detail {
+        extern char* base;
+        extern char* end;
+    }
+
+    // true for memory handed out by the arena
+    inline bool contains(const void* ptr) noexcept
+    {
+        return ptr >= detail::base && ptr < detail::end;
+    }
+
+    // allocate a block with malloc alignment, or nullptr when the
+    // reserved range is used up
+    void* allocate(size_t) noexcept;
+
+    // same, zero-filled
+    void* allocate_zeroed(size_t) noexcept;
+
+    // free a block from any of the allocate functions
+    void deallocate(void*) noexcept;
+
+    // resize a block, like realloc
+    void* reallocate(void*, size_t) noexcept;
+
+    // allocate a block at a multiple of alignment (at most 64KB)
+    void* allocate_aligned(size_t alignment, size_t size) noexcept;
+
+    // usable bytes of a block
+    size_t usable_size(const void*) noexcept;
+
+    struct Stats
+    {
+        size_t reserved;    // address space set aside
+        size_t committed;   // slabs backed by memory
+        size_t in_use;      // bytes in blocks handed out, or cached by threads
+        size_t fallback;    // allocations the arena could not serve, which
+                            // went to the real allocator instead
+    };
+
+    Stats stats() noexcept;
+
+    // take every arena lock, before fork, and release them again in
+    // both processes after it, so the child gets a consistent arena;
+    // blocks cached by threads that did not survive the fork are lost
+    void lock() noexcept;
+    void unlock() noexcept;
+}
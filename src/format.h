@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+/**
+ * Binary timeline format, selected with MEMSCOPETRACK_FORMAT=binary.
+ *
+ *   file   := MAGIC VERSION record*
+ *   record := SCOPE varint(id) varint(length) name     scope definition
+ *           | TICK varint(dt) varint(count) change*    snapshot
+ *           | SERIES varint(kind) varint(count) change*
+ *   change := varint(id - previous id) varint(zigzag(bytes - previous bytes))
+ *
+ * Each scope is defined once, before the first snapshot that uses it.
+ * dt is the time in microseconds since the previous snapshot, or since
+ * the start of tracking for the first one. A snapshot lists only the
+ * scopes whose byte count changed, in increasing id order, so the
+ * "previous id" of the first change is 0.
+ *
+ * A TICK holds live heap bytes. SERIES records that follow it hold other
+ * per-scope values of the same snapshot (see the series kinds below),
+ * delta-encoded against the previous record of the same kind.
+ *
+ * The text format writes "---<usec>" and then "<scope>|<bytes>" for the
+ * heap bytes of every scope, followed by "+<series> <scope>|<value>" lines
+ * for the values of the other series that changed since the previous
+ * snapshot, starting from 0. A reader carries the other values forward.
+ * The socket query answers with one snapshot, and its non-zero values.
+ */
+namespace format {
+    constexpr char MAGIC[4] = {'M','S','T','B'};
+    constexpr uint8_t VERSION = 1;
+
+    // record types
+    constexpr char SCOPE = 'S';
+    constexpr char TICK = 'T';
+    constexpr char EVENTS = 'E';
+    constexpr char SERIES = 'V';
+
+    // series kinds besides heap bytes
+    constexpr uint8_t MAPPED = 1;       // live bytes mapped with mmap
+    constexpr uint8_t ALLOCS = 2;       // allocations so far
+    constexpr uint8_t FREES = 3;        // frees so far
+    constexpr uint8_t ALLOCATED = 4;    // bytes allocated so far
+    constexpr uint8_t PEAK = 5;         // most live heap bytes since the last snapshot
+
+    // Allocations so far by size class: kind SIZES+c counts sizes in
+    // [2^c, 2^(c+1)). Class 0 also holds empty allocations, and the last
+    // class everything larger.
+    constexpr uint8_t SIZES = 32;
+    constexpr unsigned SIZE_CLASSES = 32;
+
+    inline unsigned size_class(uint64_t size)
+    {
+        if (size == 0) {
+            return 0;
+        }
+        unsigned c = 63 - __builtin_clzll(size);
+        return c < SIZE_CLASSES ? c : SIZE_CLASSES-1;
+    }
+
+    // Breakdowns of the heap bytes, with MEMSCOPETRACK_BREAKDOWN: kind
+    // NODES+n holds the live bytes of each scope allocated by threads
+    // running on NUMA node n, and kind THREADS+t the live bytes allocated
+    // by the thread with kernel id t. Thread id 0 stands for threads
+    // beyond the limit of distinct threads.
+    constexpr uint64_t NODES = 64;
+    constexpr unsigned MAX_NODES = 64;
+    constexpr uint64_t THREADS = uint64_t(1) << 32;
+
+    inline std::string series_name(uint64_t kind)
+    {
+        if (kind >= SIZES && kind < SIZES+SIZE_CLASSES) {
+            return "size" + std::to_string(kind - SIZES);
+        }
+        if (kind >= NODES && kind < NODES+MAX_NODES) {
+            return "node" + std::to_string(kind - NODES);
+        }
+        if (kind >= THREADS) {
+            return "thread" + std::to_string(kind - THREADS);
+        }
+        switch (kind) {
+            case MAPPED: return "mapped";
+            case ALLOCS: return "allocs";
+            case FREES: return "frees";
+            case ALLOCATED: return "allocated";
+            case PEAK: return "peak";
+            default: return "unknown";
+        }
+    }
+
+    // the kind of a series name, or false if there is no such series;
+    // heap bytes are kind 0
+    inline bool series_kind(const std::string& name, uint64_t& kind)
+    {
+        auto numbered = [&](const char* prefix, uint64_t first, uint64_t count) {
+            size_t length = strlen(prefix);
+            if (name.compare(0, length, prefix) != 0 || name.size() == length
+                    || name.find_first_not_of("0123456789", length) != std::string::npos) {
+                return false;
+            }
+            uint64_t n = strtoull(name.c_str()+length, nullptr, 10);
+            if (n >= count) {
+                return false;
+            }
+            kind = first + n;
+            return true;
+        };
+        if (name == "heap") {
+            kind = 0;
+            return true;
+        }
+        for(uint64_t k=MAPPED;k<=PEAK;k++) {
+            if (series_name(k) == name) {
+                kind = k;
+                return true;
+            }
+        }
+        return numbered("size", SIZES, SIZE_CLASSES)
+               || numbered("node", NODES, MAX_NODES)
+               || numbered("thread", THREADS, uint64_t(1) << 32);
+    }
+
+    /**
+     * Event stream format, selected with MEMSCOPETRACK_EVENTS=<file>.
+     *
+     *   file   := EVENT_MAGIC VERSION record*
+     *   record := SCOPE varint(id) varint(length) name     scope definition
+     *           | EVENTS varint(count) Event*              batch of events
+     *
+     * Events are raw little-endian Event structs, in the order each thread
+     * produced them; batches from different threads interleave.
+     */
+    constexpr char EVENT_MAGIC[4] = {'M','S','T','E'};
+
+    struct Event
+    {
+        uint64_t time;      // nanoseconds since the start of tracking
+        uint64_t addr;
+        uint64_t size;      // bytes accounted to the scope
+        uint32_t scope;
+        uint32_t thread;
+        uint8_t type;
+        uint8_t padding[7];
+    };
+    static_assert(sizeof(Event) == 40, "event records have a fixed size");
+
+    // event types
+    constexpr uint8_t ALLOC = 1;
+    constexpr uint8_t FREE = 2;
+
+    /**
+     * Shared memory segment, selected with MEMSCOPETRACK_SHM=<name> and
+     * created as /dev/shm/<name>. It is rewritten at every snapshot:
+     *
+     *   ShmHeader
+     *   names    at names_offset: per scope id from 1, uint32 length + name
+     *   ShmScope[capacity] at values_offset, indexed by scope id
+     *
+     * All fields are little-endian and naturally aligned 64 bit words
+     * (32 bit for lengths and counts), written with atomic stores. seq is
+     * odd while a snapshot is being written: a reader copies what it
+     * needs and retries if seq was odd or changed meanwhile. Names are
+     * only ever appended, so names of ids below scopes stay valid.
+     */
+    constexpr char SHM_MAGIC[4] = {'M','S','T','S'};
+
+    struct ShmHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t seq;
+        uint64_t usec;          // time of the last snapshot
+        uint32_t capacity;      // number of ShmScope slots
+        uint32_t scopes;        // ids below this have a name and values
+        uint64_t names_offset;
+        uint64_t names_size;    // bytes reserved for names
+        uint64_t names_used;
+        uint64_t values_offset;
+        uint64_t truncated;     // scopes left out for lack of room
+    };
+
+    struct ShmScope
+    {
+        uint64_t heap;          // live heap bytes
+        uint64_t peak;          // see PEAK
+        uint64_t mapped;        // see MAPPED
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t allocated;
+    };
+    static_assert(sizeof(ShmHeader) == 72, "fixed segment layout");
+    static_assert(sizeof(ShmScope) == 48, "fixed segment layout");
+
+    inline void put_varint(std::string& out, uint64_t value)
+    {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // decode a varint, returning false if the input ends first
+    inline bool get_varint(const char*& pos, const char* end, uint64_t& value)
+    {
+        value = 0;
+        for(unsigned shift=0; pos < end && shift < 64; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*pos++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+} // end namespace format
@@ -2,12 +2,32 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdarg>
+#include <new>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "track.h"
+#include "arena.h"
+
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4 // Linux 5.7, newer than some C libraries
+#endif
 
 // keep track of original functions we are overloading
 namespace overloads {
+    void init();
+
+    // Stand-ins for the hot functions until init has looked up the real
+    // ones, so their overloads need not check on every call.
+    void* first_malloc(size_t) noexcept;
+    void first_free(void*) noexcept;
+    void* first_calloc(size_t, size_t) noexcept;
+    void* first_realloc(void*, size_t) noexcept;
+
     template <typename Signature, typename T>
     struct base
     {
@@ -35,68 +55,332 @@ namespace overloads {
     struct malloc_t : public base<void*(*)(size_t), malloc_t>
     {
         static constexpr const char* identifier = "malloc";
-    } malloc;
+    } malloc{{&first_malloc}};
 
     struct free_t : public base<void(*)(void*), free_t>
     {
         static constexpr const char* identifier = "free";
-    } free;
+    } free{{&first_free}};
 
     struct calloc_t : public base<void*(*)(size_t,size_t), calloc_t>
     {
         static constexpr const char* identifier = "calloc";
-    } calloc;
+    } calloc{{&first_calloc}};
 
     struct realloc_t : public base<void*(*)(void*,size_t), realloc_t>
     {
         static constexpr const char* identifier = "realloc";
-    } realloc;
+    } realloc{{&first_realloc}};
 
-    /**
-     * Dummy implementation for calloc, to get bootstrapped.
-     * This is only called at startup and will eventually be replaced by the
-     * "proper" calloc implementation.
-     */
-    void* dummy_calloc(size_t num, size_t size) noexcept
-    {
-        const size_t MAX_SIZE = 1024;
-        static char* buf[MAX_SIZE];
-        static size_t offset = 0;
-        if (!offset) {
-            memset(buf, 0, MAX_SIZE);
-        }
-        size_t oldOffset = offset;
-        offset += num * size;
-        if (offset >= MAX_SIZE) {
-            fprintf(stderr, "failed to initialize, dummy calloc buf size exhausted: "
-                            "%zu requested, %zu available\n",
-                    offset, MAX_SIZE);
-            abort();
+    struct malloc_usable_size_t : public base<size_t(*)(void*), malloc_usable_size_t>
+    {
+        static constexpr const char* identifier = "malloc_usable_size";
+    } malloc_usable_size;
+
+    struct posix_memalign_t : public base<int(*)(void**,size_t,size_t), posix_memalign_t>
+    {
+        static constexpr const char* identifier = "posix_memalign";
+    } posix_memalign;
+
+    struct aligned_alloc_t : public base<void*(*)(size_t,size_t), aligned_alloc_t>
+    {
+        static constexpr const char* identifier = "aligned_alloc";
+    } aligned_alloc;
+
+    struct memalign_t : public base<void*(*)(size_t,size_t), memalign_t>
+    {
+        static constexpr const char* identifier = "memalign";
+    } memalign;
+
+    struct valloc_t : public base<void*(*)(size_t), valloc_t>
+    {
+        static constexpr const char* identifier = "valloc";
+    } valloc;
+
+    struct pvalloc_t : public base<void*(*)(size_t), pvalloc_t>
+    {
+        static constexpr const char* identifier = "pvalloc";
+    } pvalloc;
+
+    struct mmap_t : public base<void*(*)(void*,size_t,int,int,int,off_t), mmap_t>
+    {
+        static constexpr const char* identifier = "mmap";
+    } mmap;
+
+    struct munmap_t : public base<int(*)(void*,size_t), munmap_t>
+    {
+        static constexpr const char* identifier = "munmap";
+    } munmap;
+
+    struct mremap_t : public base<void*(*)(void*,size_t,size_t,int,...), mremap_t>
+    {
+        static constexpr const char* identifier = "mremap";
+    } mremap;
+
+    static size_t page_size = 4096;
+
+    // the kernel maps and unmaps whole pages
+    inline size_t page_round(size_t length) noexcept
+    {
+        return (length + page_size - 1) & ~(page_size - 1);
+    }
+
+    // The tracker's own allocations go to its arena, and only reach the
+    // real allocator when the arena is full. During init there is no real
+    // allocator yet, which is what dlsym gets to use.
+    inline void* internal(size_t size) noexcept
+    {
+        void* ptr = arena::allocate(size);
+        return ptr ? ptr : overloads::malloc(size);
+    }
+
+    // Header and stack modes have every call take the slow path.
+    constexpr uint32_t MODE_HEADER = 1;
+    constexpr uint32_t MODE_UNSCOPED = 2;
+    static uint32_t modes = 0;
+
+    // True if a call needs nothing but the real function: no scope to
+    // account to, not tracker code, and no mode on. One TLS access and
+    // one branch, which is the whole cost for untracked code.
+    __attribute__((always_inline))
+    inline bool untracked() noexcept
+    {
+        const memory::ThreadContext& c = memory::context;
+        return __builtin_expect((c.scope | c.in_tracker | modes) == 0, 1);
+    }
+
+    // True if freeing needs nothing but the real function, as no block
+    // is in the address table and none has a header. One load and one
+    // branch, and no TLS access.
+    __attribute__((always_inline))
+    inline bool nothing_to_release() noexcept
+    {
+        return __builtin_expect(!memory::any_tracked.load(std::memory_order_relaxed)
+                                && (modes & MODE_HEADER) == 0, 1);
+    }
+} // end namespace overloads
+
+/**
+ * Optional hidden-header mode, enabled with MEMSCOPETRACK_HEADER=1.
+ *
+ * Each block is over-allocated by a 16 byte header holding its scope and
+ * size, so free() can account for it without the address table.
+ * The header keeps the 16 byte alignment malloc guarantees.
+ */
+namespace tagging {
+    struct Header
+    {
+        uint64_t size;      // bytes accounted to the scope
+        uint32_t scope;
+        uint32_t magic;
+    };
+    static_assert(sizeof(Header) == 16, "header must preserve malloc alignment");
+
+    // The word holding the magic overlays the upper half of the glibc
+    // chunk size field for blocks without a header, which is zero for
+    // any block under 4GB, so a header-less block is never mistaken
+    // for a tagged one.
+    constexpr uint32_t MAGIC = 0x4d535448;
+
+    // Blocks aligned beyond 16 bytes have padding in front of the header,
+    // and the raw block address stored in the 8 bytes before it.
+    constexpr uint32_t MAGIC_ALIGNED = 0x4d535441;
+
+    static bool enabled = false;
+
+    inline Header* header(void* ptr) noexcept
+    {
+        return static_cast<Header*>(ptr) - 1;
+    }
+
+    inline bool is_tagged(void* ptr) noexcept
+    {
+        if (!ptr || arena::contains(ptr)) {
+            return false;
+        }
+        uint32_t magic = header(ptr)->magic;
+        return magic == MAGIC || magic == MAGIC_ALIGNED;
+    }
+
+    // the raw block a tagged pointer was carved from
+    inline void* raw(void* ptr) noexcept
+    {
+        Header* h = header(ptr);
+        if (h->magic == MAGIC_ALIGNED) {
+            return reinterpret_cast<void**>(h)[-1];
+        }
+        return h;
+    }
+
+    // fill in the header in front of ptr, returning ptr
+    inline void* tag_at(void* ptr, size_t size, uint32_t magic) noexcept
+    {
+        Header* h = header(ptr);
+        size_t accounted;
+        h->scope = memory::track_tagged(ptr, size, accounted);
+        h->size = accounted;
+        h->magic = magic;
+        return ptr;
+    }
+
+    // fill in the header at the start of a raw block, returning the user pointer
+    inline void* tag(void* base, size_t size) noexcept
+    {
+        return tag_at(static_cast<Header*>(base) + 1, size, MAGIC);
+    }
+
+    // account for a tagged block being freed, returning the raw block
+    inline void* untag(void* ptr) noexcept
+    {
+        Header* h = header(ptr);
+        void* base = raw(ptr);
+        h->magic = 0;
+        memory::release_tagged(ptr, h->scope, h->size);
+        return base;
+    }
+
+    // total raw size, or false on overflow
+    inline bool raw_size(size_t size, size_t& out) noexcept
+    {
+        return !__builtin_add_overflow(size, sizeof(Header), &out);
+    }
+
+    // usable bytes after ptr
+    inline size_t usable_size(void* ptr) noexcept
+    {
+        char* base = static_cast<char*>(raw(ptr));
+        return overloads::malloc_usable_size(base) - (static_cast<char*>(ptr) - base);
+    }
+
+    // allocate a tagged block with a power of two alignment
+    inline void* aligned(size_t alignment, size_t size) noexcept
+    {
+        if (alignment <= sizeof(Header)) {
+            size_t total;
+            if (!raw_size(size, total)) {
+                return nullptr;
+            }
+            void* base = overloads::malloc(total);
+            return base ? tag(base, size) : nullptr;
+        }
+        // room for the alignment padding, the header and the raw address
+        size_t total;
+        if (__builtin_add_overflow(size, alignment + sizeof(Header) + sizeof(void*), &total)) {
+            return nullptr;
+        }
+        void* base = overloads::malloc(total);
+        if (!base) {
+            return nullptr;
         }
-        return buf + oldOffset;
+        uintptr_t start = reinterpret_cast<uintptr_t>(base) + sizeof(Header) + sizeof(void*);
+        uintptr_t user = (start + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+        void* ptr = reinterpret_cast<void*>(user);
+        reinterpret_cast<void**>(header(ptr))[-1] = base;
+        return tag_at(ptr, size, MAGIC_ALIGNED);
     }
+} // end namespace tagging
+
+namespace overloads {
+    static bool initialized = false;
 
     void init()
     {
-        overloads::calloc.original = &dummy_calloc;
+        // Only allocations should get here during init, and those go to
+        // the arena; a second call means the arena failed too.
+        if (initialized) {
+            fprintf(stderr, "failed to initialize, no memory for the tracker\n");
+            abort();
+        }
+        initialized = true;
+
+        // allocations made while setting up, by dlsym and the tracker,
+        // are the tracker's own
+        bool in_tracker = memory::context.in_tracker;
+        memory::context.in_tracker = true;
+
         overloads::malloc.init();
         overloads::free.init();
         overloads::calloc.init();
         overloads::realloc.init();
+        overloads::malloc_usable_size.init();
+        overloads::posix_memalign.init();
+        overloads::aligned_alloc.init();
+        overloads::memalign.init();
+        overloads::valloc.init();
+        overloads::pvalloc.init();
+        overloads::mmap.init();
+        overloads::munmap.init();
+        overloads::mremap.init();
+        page_size = sysconf(_SC_PAGESIZE);
+
+        char* header = std::getenv("MEMSCOPETRACK_HEADER");
+        tagging::enabled = header != nullptr && strcmp(header, "0") != 0;
 
         memory::init();
 
-        // unset to prevent measuring subprocesses
-        unsetenv("LD_PRELOAD");
+        // unset to prevent measuring subprocesses, unless asked to
+        if (!memory::follow_exec()) {
+            unsetenv("LD_PRELOAD");
+        }
+
+        memory::context.in_tracker = in_tracker;
+        modes = (tagging::enabled ? MODE_HEADER : 0)
+                | (memory::track_unscoped() ? MODE_UNSCOPED : 0);
     }
-} // end namespace overloads
 
-// the actual overloads happen here, in C to be fully compliant
-extern "C" {
-    void* malloc(size_t size) noexcept
+    // set up when the library is loaded, unless an allocation in an
+    // earlier constructor has done so already
+    __attribute__((constructor(101)))
+    static void preload()
     {
-        if (!overloads::malloc) {
-            overloads::init();
+        if (!initialized) {
+            init();
+        }
+    }
+
+    void* first_malloc(size_t size) noexcept
+    {
+        init();
+        return overloads::malloc(size);
+    }
+
+    void first_free(void* ptr) noexcept
+    {
+        init();
+        overloads::free(ptr);
+    }
+
+    void* first_calloc(size_t num, size_t size) noexcept
+    {
+        init();
+        return overloads::calloc(num, size);
+    }
+
+    void* first_realloc(void* ptr, size_t size) noexcept
+    {
+        init();
+        return overloads::realloc(ptr, size);
+    }
+
+    /**
+     * The slow paths of the hot overloads: tracker code, header mode,
+     * and anything that is tracked. Kept out of line so the fast paths
+     * below stay small enough to inline into the overloads.
+     */
+    __attribute__((noinline))
+    void* malloc_slow(size_t size) noexcept
+    {
+        if (memory::context.in_tracker) {
+            return internal(size);
+        }
+
+        if (tagging::enabled) {
+            size_t raw;
+            if (!tagging::raw_size(size, raw)) {
+                return nullptr;
+            }
+            void* base = overloads::malloc(raw);
+            return base ? tagging::tag(base, size) : nullptr;
         }
 
         void* ptr = overloads::malloc(size);
@@ -108,10 +392,12 @@ extern "C" {
         return ptr;
     }
 
-    void free(void* ptr) noexcept
+    __attribute__((noinline))
+    void free_slow(void* ptr) noexcept
     {
-        if (!overloads::free) {
-            overloads::init();
+        if (tagging::enabled && tagging::is_tagged(ptr)) {
+            overloads::free(tagging::untag(ptr));
+            return;
         }
 
         memory::release(ptr);
@@ -119,10 +405,25 @@ extern "C" {
         overloads::free(ptr);
     }
 
-    void* calloc(size_t num, size_t size) noexcept
+    __attribute__((noinline))
+    void* calloc_slow(size_t num, size_t size) noexcept
     {
-        if (!overloads::calloc) {
-            overloads::init();
+        if (memory::context.in_tracker) {
+            size_t bytes;
+            if (__builtin_mul_overflow(num, size, &bytes)) {
+                return nullptr;
+            }
+            void* ptr = arena::allocate_zeroed(bytes);
+            return ptr ? ptr : overloads::calloc(num, size);
+        }
+
+        if (tagging::enabled) {
+            size_t bytes, raw;
+            if (__builtin_mul_overflow(num, size, &bytes) || !tagging::raw_size(bytes, raw)) {
+                return nullptr;
+            }
+            void* base = overloads::calloc(1, raw);
+            return base ? tagging::tag(base, bytes) : nullptr;
         }
 
         void* ptr = overloads::calloc(num, size);
@@ -134,10 +435,103 @@ extern "C" {
         return ptr;
     }
 
+    __attribute__((noinline))
+    void* realloc_arena(void* ptr, size_t size) noexcept
+    {
+        void* out_ptr = arena::reallocate(ptr, size);
+        if (!out_ptr && size != 0) {
+            // the arena is full, so move out to the real allocator
+            out_ptr = overloads::malloc(size);
+            if (out_ptr) {
+                memcpy(out_ptr, ptr, arena::usable_size(ptr));
+                arena::deallocate(ptr);
+            }
+        }
+        return out_ptr;
+    }
+} // end namespace overloads
+
+// the actual overloads happen here, in C to be fully compliant
+extern "C" {
+    void* malloc(size_t size) noexcept
+    {
+        if (overloads::untracked()) {
+            return overloads::malloc(size);
+        }
+        return overloads::malloc_slow(size);
+    }
+
+    void free(void* ptr) noexcept
+    {
+        if (arena::contains(ptr)) {
+            arena::deallocate(ptr);
+            return;
+        }
+        if (overloads::nothing_to_release()) {
+            overloads::free(ptr);
+            return;
+        }
+        // any block may have been tracked, whatever the current scope
+        if (ptr && !memory::context.in_tracker) {
+            overloads::free_slow(ptr);
+            return;
+        }
+        overloads::free(ptr);
+    }
+
+    void* calloc(size_t num, size_t size) noexcept
+    {
+        if (overloads::untracked()) {
+            return overloads::calloc(num, size);
+        }
+        return overloads::calloc_slow(num, size);
+    }
+
     void* realloc(void* ptr, size_t size) noexcept
     {
-        if (!overloads::realloc) {
-            overloads::init();
+        if (arena::contains(ptr)) {
+            return overloads::realloc_arena(ptr, size);
+        }
+        // neither the old block nor the new one needs tracking
+        if (overloads::untracked() && overloads::nothing_to_release()) {
+            return overloads::realloc(ptr, size);
+        }
+        if (memory::context.in_tracker) {
+            // blocks from before the arena, or from when it was full
+            return ptr ? overloads::realloc(ptr, size) : overloads::internal(size);
+        }
+
+        if (tagging::enabled && tagging::is_tagged(ptr)) {
+            if (size == 0) {
+                overloads::free(tagging::untag(ptr));
+                return nullptr;
+            }
+            if (tagging::header(ptr)->magic == tagging::MAGIC_ALIGNED) {
+                // realloc does not keep the alignment, so move to a plain block
+                void* out_ptr = malloc(size);
+                if (out_ptr) {
+                    size_t old_size = tagging::usable_size(ptr);
+                    memcpy(out_ptr, ptr, old_size < size ? old_size : size);
+                    free(ptr);
+                }
+                return out_ptr;
+            }
+            size_t raw;
+            if (!tagging::raw_size(size, raw)) {
+                return nullptr;
+            }
+            // the old block stays valid if realloc fails, so only
+            // release it once the new one exists
+            tagging::Header old = *tagging::header(ptr);
+            void* base = overloads::realloc(tagging::header(ptr), raw);
+            if (!base) {
+                return nullptr;
+            }
+            memory::release_tagged(ptr, old.scope, old.size);
+            return tagging::tag(base, size);
+        }
+        if (tagging::enabled && !ptr) {
+            return malloc(size);
         }
         
         void* out_ptr = overloads::realloc(ptr, size);
@@ -151,4 +545,314 @@ extern "C" {
 
         return out_ptr;
     }
+
+    size_t malloc_usable_size(void* ptr) noexcept
+    {
+        if (arena::contains(ptr)) {
+            return arena::usable_size(ptr);
+        }
+
+        if (!overloads::malloc_usable_size) {
+            overloads::init();
+        }
+
+        if (tagging::enabled && tagging::is_tagged(ptr)) {
+            return tagging::usable_size(ptr);
+        }
+
+        return overloads::malloc_usable_size(ptr);
+    }
+
+    int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
+    {
+        if (memory::context.in_tracker && alignment % sizeof(void*) == 0
+            && (alignment & (alignment - 1)) == 0) {
+            void* ptr = arena::allocate_aligned(alignment, size);
+            if (ptr) {
+                *memptr = ptr;
+                return 0;
+            }
+        }
+
+        if (!overloads::posix_memalign) {
+            overloads::init();
+        }
+
+        if (tagging::enabled) {
+            if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+                return EINVAL;
+            }
+            void* ptr = tagging::aligned(alignment, size);
+            if (!ptr) {
+                return ENOMEM;
+            }
+            *memptr = ptr;
+            return 0;
+        }
+
+        int ret = overloads::posix_memalign(memptr, alignment, size);
+
+        if (ret == 0 && *memptr) {
+            memory::track(*memptr,size);
+        }
+
+        return ret;
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) noexcept
+    {
+        if (memory::context.in_tracker && alignment != 0 && (alignment & (alignment - 1)) == 0) {
+            void* ptr = arena::allocate_aligned(alignment, size);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        if (!overloads::aligned_alloc) {
+            overloads::init();
+        }
+
+        if (tagging::enabled) {
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                errno = EINVAL;
+                return nullptr;
+            }
+            return tagging::aligned(alignment, size);
+        }
+
+        void* ptr = overloads::aligned_alloc(alignment, size);
+
+        if (ptr) {
+            memory::track(ptr,size);
+        }
+
+        return ptr;
+    }
+
+    void* memalign(size_t alignment, size_t size) noexcept
+    {
+        if (memory::context.in_tracker) {
+            void* ptr = arena::allocate_aligned(alignment, size);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        if (!overloads::memalign) {
+            overloads::init();
+        }
+
+        if (tagging::enabled) {
+            // like glibc, round the alignment up to a power of two
+            size_t a = sizeof(void*);
+            while (a < alignment) {
+                a <<= 1;
+            }
+            return tagging::aligned(a, size);
+        }
+
+        void* ptr = overloads::memalign(alignment, size);
+
+        if (ptr) {
+            memory::track(ptr,size);
+        }
+
+        return ptr;
+    }
+
+    void* valloc(size_t size) noexcept
+    {
+        if (memory::context.in_tracker) {
+            void* ptr = arena::allocate_aligned(overloads::page_size, size);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        if (!overloads::valloc) {
+            overloads::init();
+        }
+
+        if (tagging::enabled) {
+            return tagging::aligned(overloads::page_size, size);
+        }
+
+        void* ptr = overloads::valloc(size);
+
+        if (ptr) {
+            memory::track(ptr,size);
+        }
+
+        return ptr;
+    }
+
+    void* pvalloc(size_t size) noexcept
+    {
+        if (!overloads::pvalloc) {
+            overloads::init();
+        }
+
+        // pvalloc rounds the size up to whole pages
+        size_t page = overloads::page_size;
+        size_t rounded = size ? (size + page - 1) & ~(page - 1) : page;
+
+        if (memory::context.in_tracker) {
+            void* ptr = arena::allocate_aligned(page, rounded);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        if (tagging::enabled) {
+            return tagging::aligned(page, rounded);
+        }
+
+        void* ptr = overloads::pvalloc(size);
+
+        if (ptr) {
+            memory::track(ptr,rounded);
+        }
+
+        return ptr;
+    }
+
+    void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) noexcept
+    {
+        if (!overloads::mmap) {
+            overloads::init();
+        }
+
+        void* ptr = overloads::mmap(addr, length, prot, flags, fd, offset);
+
+        if (ptr != MAP_FAILED) {
+            memory::track_mapping(ptr, overloads::page_round(length));
+        }
+
+        return ptr;
+    }
+
+    int munmap(void* addr, size_t length) noexcept
+    {
+        if (!overloads::munmap) {
+            overloads::init();
+        }
+
+        int ret = overloads::munmap(addr, length);
+
+        if (ret == 0) {
+            memory::release_mapping(addr, overloads::page_round(length));
+        }
+
+        return ret;
+    }
+
+    void* mremap(void* old_addr, size_t old_length, size_t length, int flags, ...) noexcept
+    {
+        if (!overloads::mremap) {
+            overloads::init();
+        }
+
+        void* ptr;
+        if (flags & MREMAP_FIXED) {
+            va_list args;
+            va_start(args, flags);
+            void* new_addr = va_arg(args, void*);
+            va_end(args);
+            ptr = overloads::mremap(old_addr, old_length, length, flags, new_addr);
+        } else {
+            ptr = overloads::mremap(old_addr, old_length, length, flags);
+        }
+
+        if (ptr != MAP_FAILED) {
+            memory::remap(old_addr, overloads::page_round(old_length),
+                          ptr, overloads::page_round(length),
+                          (flags & MREMAP_DONTUNMAP) != 0);
+        }
+
+        return ptr;
+    }
 } // end extern C
+
+/**
+ * Replacement operator new/delete, so C++ allocations are tracked
+ * without depending on how libstdc++ reaches malloc.
+ *
+ * Everything goes through the C overloads above, so a block from new
+ * can still be released by free() and vice versa, as glibc allows.
+ */
+namespace cxx {
+    inline void* allocate(size_t size)
+    {
+        if (size == 0) {
+            size = 1; // new must return a unique pointer
+        }
+        for (;;) {
+            void* ptr = malloc(size);
+            if (ptr) {
+                return ptr;
+            }
+            std::new_handler handler = std::get_new_handler();
+            if (!handler) {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    inline void* allocate(size_t size, std::align_val_t al)
+    {
+        size_t alignment = static_cast<size_t>(al);
+        if (alignment < sizeof(void*)) {
+            alignment = sizeof(void*);
+        }
+        if (size == 0) {
+            size = 1;
+        }
+        for (;;) {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, alignment, size) == 0) {
+                return ptr;
+            }
+            std::new_handler handler = std::get_new_handler();
+            if (!handler) {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    template <typename... Args>
+    inline void* allocate_nothrow(Args... args) noexcept
+    {
+        try {
+            return allocate(args...);
+        } catch (...) {
+            return nullptr;
+        }
+    }
+} // end namespace cxx
+
+void* operator new(size_t size) { return cxx::allocate(size); }
+void* operator new[](size_t size) { return cxx::allocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return cxx::allocate_nothrow(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return cxx::allocate_nothrow(size); }
+void* operator new(size_t size, std::align_val_t al) { return cxx::allocate(size, al); }
+void* operator new[](size_t size, std::align_val_t al) { return cxx::allocate(size, al); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return cxx::allocate_nothrow(size, al); }
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return cxx::allocate_nothrow(size, al); }
+
+// The size passed to sized delete is not used: the block may just as
+// well be freed by C code, so the address table (or header) stays the
+// authority on what a block accounted for.
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
@@ -0,0 +1,933 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/array.hpp>
+
+#include "format.h"
+
+/**
+ * memscopetrack-report: summarize the tracker's output files.
+ *
+ * Reads timelines in the text or binary format and event files (see
+ * format.h), plain or gzipped, and prints for each the peak,
+ * time-averaged and final value of the top scopes, optionally per time
+ * window. Files are mapped rather than read, and several files are
+ * summarized at once, one per thread. Each file can also be converted
+ * to CSV, and the summaries of all files collected in one CSV table.
+ */
+namespace {
+
+    struct Options
+    {
+        std::string series = "heap";
+        size_t top = 10;
+        double window = 0;          // seconds per window, 0 for none
+        std::string csv_dir;        // convert each file to <dir>/<name>.csv
+        std::string summary_csv;    // summaries of all files
+        unsigned jobs = 0;
+    };
+
+    // the input ended in the middle of a record, e.g. from a job that
+    // did not exit cleanly
+    struct Truncated {};
+
+
+    // a whole input file, mapped, and gunzipped a block at a time if needed
+    class Input
+    {
+    public:
+        explicit Input(const std::string& filename);
+        ~Input();
+
+        // non-copyable
+        Input(const Input&) = delete;
+        Input& operator=(const Input&) = delete;
+
+        // have at least n bytes from pos on, false if the input ends first
+        bool ensure(size_t n);
+
+        // read a varint, throwing Truncated if the input ends first
+        uint64_t varint();
+
+        const char* pos;
+        const char* end;
+        bool truncated;     // a gzipped file ended early
+
+    private:
+        static constexpr size_t BLOCK = 1<<20;
+
+        char* map_;
+        size_t map_size_;
+        std::unique_ptr<boost::iostreams::filtering_istreambuf> gunzip_;
+        std::vector<char> buf_;
+        bool eof_;
+    };
+
+    Input::Input(const std::string& filename)
+        : pos(nullptr), end(nullptr), truncated(false), map_(nullptr), map_size_(0), eof_(true)
+    {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(strerror(err));
+        }
+        map_size_ = st.st_size;
+        if (map_size_ > 0) {
+            void* p = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                int err = errno;
+                close(fd);
+                throw std::runtime_error(strerror(err));
+            }
+            map_ = static_cast<char*>(p);
+            madvise(map_, map_size_, MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        if (map_size_ >= 2 && static_cast<uint8_t>(map_[0]) == 0x1f
+                && static_cast<uint8_t>(map_[1]) == 0x8b) {
+            gunzip_ = std::make_unique<boost::iostreams::filtering_istreambuf>();
+            gunzip_->push(boost::iostreams::gzip_decompressor());
+            gunzip_->push(boost::iostreams::array_source(map_, map_size_));
+            eof_ = false;
+        } else {
+            pos = map_;
+            end = map_ + map_size_;
+        }
+    }
+
+    Input::~Input()
+    {
+        gunzip_.reset();
+        if (map_ != nullptr) {
+            munmap(map_, map_size_);
+        }
+    }
+
+    bool
+    Input::ensure(size_t n)
+    {
+        while (static_cast<size_t>(end - pos) < n) {
+            if (eof_) {
+                return false;
+            }
+            // keep the unread bytes, and fill up the rest of the buffer
+            size_t left = end - pos;
+            if (left > 0 && pos != buf_.data()) {
+                memmove(buf_.data(), pos, left);
+            }
+            size_t want = std::max(n, left + BLOCK);
+            if (buf_.size() < want) {
+                buf_.resize(want);
+            }
+            std::streamsize got = 0;
+            try {
+                got = gunzip_->sgetn(buf_.data() + left, buf_.size() - left);
+            } catch (std::exception&) {
+                truncated = true;
+            }
+            if (got <= 0) {
+                eof_ = true;
+                got = 0;
+            }
+            pos = buf_.data();
+            end = pos + left + got;
+        }
+        return true;
+    }
+
+    uint64_t
+    Input::varint()
+    {
+        ensure(10);
+        uint64_t value;
+        if (!format::get_varint(pos, end, value)) {
+            throw Truncated();
+        }
+        return value;
+    }
+
+
+    // one line of a summary
+    struct Row
+    {
+        std::string scope;
+        int64_t peak;
+        double average;     // over time
+        int64_t final;
+    };
+
+    struct Window
+    {
+        double start;
+        double end;
+        std::vector<Row> top;
+    };
+
+    // the outcome for one input file
+    struct Report
+    {
+        std::string filename;
+        std::string format;
+        std::string error;
+        bool truncated = false;
+        uint64_t records = 0;   // snapshots, or events
+        double duration = 0;
+        size_t scopes = 0;
+        std::vector<Row> rows;  // the top scopes, or all for the summary CSV
+        std::vector<Window> windows;
+    };
+
+
+    // rows of (seconds, scope, value), one per change of a value
+    class CsvWriter
+    {
+    public:
+        explicit CsvWriter(const std::string& filename);
+        ~CsvWriter();
+
+        // non-copyable
+        CsvWriter(const CsvWriter&) = delete;
+        CsvWriter& operator=(const CsvWriter&) = delete;
+
+        void row(double t, const std::string& scope, int64_t value);
+
+        static std::string quote(const std::string& field);
+
+    private:
+        FILE* f_;
+    };
+
+    CsvWriter::CsvWriter(const std::string& filename)
+        : f_(fopen(filename.c_str(), "w"))
+    {
+        if (f_ == nullptr) {
+            throw std::runtime_error(filename + ": " + strerror(errno));
+        }
+        setvbuf(f_, nullptr, _IOFBF, 1<<20);
+        fputs("seconds,scope,value\n", f_);
+    }
+
+    CsvWriter::~CsvWriter()
+    {
+        fclose(f_);
+    }
+
+    void
+    CsvWriter::row(double t, const std::string& scope, int64_t value)
+    {
+        fprintf(f_, "%.6f,%s,%lld\n", t, quote(scope).c_str(), static_cast<long long>(value));
+    }
+
+    std::string
+    CsvWriter::quote(const std::string& field)
+    {
+        if (field.find_first_of(",\"\n") == std::string::npos) {
+            return field;
+        }
+        std::string out = "\"";
+        for(char c : field) {
+            if (c == '"') {
+                out.push_back('"');
+            }
+            out.push_back(c);
+        }
+        out.push_back('"');
+        return out;
+    }
+
+
+    // per-scope statistics, integrated over time as the values change
+    struct ScopeStats
+    {
+        int64_t value = 0;
+        int64_t peak = 0;
+        double area = 0;            // value * seconds, up to last
+        double last = 0;
+        int64_t window_peak = 0;
+        double window_area = 0;
+    };
+
+    // folds the value changes of one file into a Report
+    class Summary
+    {
+    public:
+        Summary(const Options& options, Report& report, CsvWriter* csv);
+
+        void name(uint32_t id, std::string name);
+
+        // move the clock to t seconds since the start of tracking; batches
+        // of events from different threads interleave, so a time before
+        // the current one counts as the current one
+        void advance(double t);
+
+        void set(uint32_t id, int64_t value);
+        int64_t get(uint32_t id) const
+        {
+            return id < stats_.size() ? stats_[id].value : 0;
+        }
+
+        void finish();
+
+    private:
+        ScopeStats& stats(uint32_t id);
+        const std::string& name_of(uint32_t id);
+        void close_window(double end);
+
+        const Options& options_;
+        Report& report_;
+        CsvWriter* csv_;
+        std::vector<std::string> names_;
+        std::vector<ScopeStats> stats_;
+        double now_;
+        double window_start_;
+    };
+
+    Summary::Summary(const Options& options, Report& report, CsvWriter* csv)
+        : options_(options), report_(report), csv_(csv), now_(0), window_start_(0)
+    { }
+
+    void
+    Summary::name(uint32_t id, std::string name)
+    {
+        if (names_.size() <= id) {
+            names_.resize(id+1);
+        }
+        names_[id] = std::move(name);
+    }
+
+    const std::string&
+    Summary::name_of(uint32_t id)
+    {
+        if (names_.size() <= id) {
+            names_.resize(id+1);
+        }
+        if (names_[id].empty()) {
+            names_[id] = "scope" + std::to_string(id);
+        }
+        return names_[id];
+    }
+
+    ScopeStats&
+    Summary::stats(uint32_t id)
+    {
+        if (stats_.size() <= id) {
+            // new scopes were at 0 so far, which adds nothing to the areas
+            stats_.resize(id+1);
+        }
+        return stats_[id];
+    }
+
+    void
+    Summary::advance(double t)
+    {
+        if (t < now_) {
+            t = now_;
+        }
+        if (options_.window > 0) {
+            while (t >= window_start_ + options_.window) {
+                close_window(window_start_ + options_.window);
+            }
+        }
+        now_ = t;
+    }
+
+    void
+    Summary::set(uint32_t id, int64_t value)
+    {
+        ScopeStats& s = stats(id);
+        double dt = now_ - s.last;
+        s.area += s.value * dt;
+        s.window_area += s.value * dt;
+        s.last = now_;
+        s.value = value;
+        s.peak = std::max(s.peak, value);
+        s.window_peak = std::max(s.window_peak, value);
+        if (csv_ != nullptr) {
+            csv_->row(now_, name_of(id), value);
+        }
+    }
+
+    // the top rows by peak, or all of them
+    template<typename Peak, typename Average>
+    std::vector<Row>
+    top_rows(const std::vector<ScopeStats>& stats, const std::vector<std::string>& names,
+             size_t limit, Peak peak, Average average)
+    {
+        std::vector<uint32_t> ids;
+        for(uint32_t id=0;id<stats.size();id++) {
+            if (peak(stats[id]) != 0 || stats[id].value != 0) {
+                ids.push_back(id);
+            }
+        }
+        auto higher = [&](uint32_t a, uint32_t b) {
+            if (peak(stats[a]) != peak(stats[b])) {
+                return peak(stats[a]) > peak(stats[b]);
+            }
+            return a < b;
+        };
+        if (ids.size() > limit) {
+            std::partial_sort(ids.begin(), ids.begin()+limit, ids.end(), higher);
+            ids.resize(limit);
+        } else {
+            std::sort(ids.begin(), ids.end(), higher);
+        }
+        std::vector<Row> rows;
+        for(uint32_t id : ids) {
+            std::string name = id < names.size() && !names[id].empty()
+                               ? names[id] : "scope" + std::to_string(id);
+            rows.push_back({name, peak(stats[id]), average(stats[id]), stats[id].value});
+        }
+        return rows;
+    }
+
+    void
+    Summary::close_window(double end)
+    {
+        for(auto& s : stats_) {
+            double dt = end - s.last;
+            s.area += s.value * dt;
+            s.window_area += s.value * dt;
+            s.last = end;
+        }
+        double length = end - window_start_;
+        auto rows = top_rows(stats_, names_, options_.top,
+            [](const ScopeStats& s){ return s.window_peak; },
+            [&](const ScopeStats& s){ return length > 0 ? s.window_area / length : s.value; });
+        if (!rows.empty()) {
+            report_.windows.push_back({window_start_, end, std::move(rows)});
+        }
+        for(auto& s : stats_) {
+            s.window_peak = s.value;
+            s.window_area = 0;
+        }
+        window_start_ = end;
+    }
+
+    void
+    Summary::finish()
+    {
+        if (options_.window > 0 && now_ > window_start_) {
+            close_window(now_);
+        }
+        for(auto& s : stats_) {
+            s.area += s.value * (now_ - s.last);
+            s.last = now_;
+        }
+        report_.duration = now_;
+        report_.scopes = std::max(names_.size(), stats_.size());
+        size_t limit = options_.summary_csv.empty() ? options_.top : stats_.size();
+        report_.rows = top_rows(stats_, names_, limit,
+            [](const ScopeStats& s){ return s.peak; },
+            [&](const ScopeStats& s){ return now_ > 0 ? s.area / now_ : s.value; });
+    }
+
+
+    // series kind of a series name, 0 for the heap
+    uint64_t
+    series_kind(const std::string& series)
+    {
+        uint64_t kind;
+        if (!format::series_kind(series, kind)) {
+            throw std::runtime_error("unknown series " + series);
+        }
+        return kind;
+    }
+
+    void
+    read_scope(Input& in, Summary& summary)
+    {
+        uint64_t id = in.varint();
+        uint64_t length = in.varint();
+        if (!in.ensure(length)) {
+            throw Truncated();
+        }
+        summary.name(id, std::string(in.pos, length));
+        in.pos += length;
+    }
+
+    bool
+    next_line(Input& in, std::string_view& line)
+    {
+        while (true) {
+            size_t have = in.end - in.pos;
+            if (have > 0) {
+                auto nl = static_cast<const char*>(memchr(in.pos, '\n', have));
+                if (nl != nullptr) {
+                    line = std::string_view(in.pos, nl - in.pos);
+                    in.pos = nl + 1;
+                    return true;
+                }
+            }
+            if (!in.ensure(have+1)) {
+                if (have == 0) {
+                    return false;
+                }
+                line = std::string_view(in.pos, have);
+                in.pos = in.end;
+                return true;
+            }
+        }
+    }
+
+    void
+    read_text(Input& in, const Options& options, Summary& summary, Report& report)
+    {
+        bool heap = options.series == "heap";
+        series_kind(options.series);
+
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<int64_t> current;   // values of the snapshot being read
+        std::string key;
+        bool pending = false;
+
+        // a snapshot lists every heap value, and the values of the other
+        // series that changed, so the others carry over
+        auto flush = [&]() {
+            for(uint32_t id=0;id<current.size();id++) {
+                if (current[id] != summary.get(id)) {
+                    summary.set(id, current[id]);
+                }
+            }
+        };
+
+        std::string_view line;
+        while (next_line(in, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            if (line.substr(0, 3) == "---") {
+                if (pending) {
+                    flush();
+                }
+                key.assign(line.data()+3, line.size()-3);
+                summary.advance(strtod(key.c_str(), nullptr) / 1e6);
+                report.records++;
+                pending = true;
+                continue;
+            }
+            if (line[0] == '+') {
+                size_t space = line.find(' ');
+                if (space == std::string_view::npos || line.substr(1, space-1) != options.series) {
+                    continue;
+                }
+                line.remove_prefix(space+1);
+            } else if (!heap) {
+                continue;
+            }
+            size_t bar = line.rfind('|');
+            if (bar == std::string_view::npos) {
+                continue;
+            }
+            key.assign(line.data(), bar);
+            auto it = ids.find(key);
+            if (it == ids.end()) {
+                uint32_t id = ids.size();
+                it = ids.emplace(key, id).first;
+                summary.name(id, key);
+                current.resize(id+1, 0);
+            }
+            std::string value(line.substr(bar+1));
+            current[it->second] = strtoll(value.c_str(), nullptr, 10);
+        }
+        if (pending) {
+            flush();
+        }
+    }
+
+    void
+    read_binary(Input& in, const Options& options, Summary& summary, Report& report)
+    {
+        uint64_t kind = series_kind(options.series);
+        in.pos += sizeof(format::MAGIC);
+        if (!in.ensure(1) || static_cast<uint8_t>(*in.pos) != format::VERSION) {
+            throw std::runtime_error("unsupported binary format version");
+        }
+        in.pos++;
+
+        std::vector<int64_t> values;    // of the selected series
+        uint64_t usec = 0;
+        auto read_changes = [&](bool selected) {
+            uint64_t count = in.varint();
+            uint64_t id = 0;
+            for(uint64_t i=0;i<count;i++) {
+                id += in.varint();
+                int64_t delta = format::unzigzag(in.varint());
+                if (selected) {
+                    if (values.size() <= id) {
+                        values.resize(id+1, 0);
+                    }
+                    values[id] += delta;
+                    summary.set(id, values[id]);
+                }
+            }
+        };
+
+        while (in.ensure(1)) {
+            char type = *in.pos++;
+            if (type == format::SCOPE) {
+                read_scope(in, summary);
+            } else if (type == format::TICK) {
+                usec += in.varint();
+                summary.advance(usec / 1e6);
+                report.records++;
+                read_changes(kind == 0);
+            } else if (type == format::SERIES) {
+                uint64_t series = in.varint();
+                read_changes(series == kind);
+            } else {
+                throw std::runtime_error("bad record type");
+            }
+        }
+    }
+
+    void
+    read_events(Input& in, const Options& options, Summary& summary, Report& report)
+    {
+        // series that can be derived from the events
+        enum { HEAP, ALLOCS, FREES, ALLOCATED } series;
+        if (options.series == "heap") {
+            series = HEAP;
+        } else if (options.series == "allocs") {
+            series = ALLOCS;
+        } else if (options.series == "frees") {
+            series = FREES;
+        } else if (options.series == "allocated") {
+            series = ALLOCATED;
+        } else {
+            throw std::runtime_error("event files have no " + options.series + " series");
+        }
+
+        in.pos += sizeof(format::EVENT_MAGIC);
+        if (!in.ensure(1) || static_cast<uint8_t>(*in.pos) != format::VERSION) {
+            throw std::runtime_error("unsupported event format version");
+        }
+        in.pos++;
+
+        std::vector<int64_t> values;
+        while (in.ensure(1)) {
+            char type = *in.pos++;
+            if (type == format::SCOPE) {
+                read_scope(in, summary);
+            } else if (type == format::EVENTS) {
+                uint64_t count = in.varint();
+                for(uint64_t i=0;i<count;i++) {
+                    if (!in.ensure(sizeof(format::Event))) {
+                        throw Truncated();
+                    }
+                    format::Event e;
+                    memcpy(&e, in.pos, sizeof(e));
+                    in.pos += sizeof(e);
+                    report.records++;
+
+                    int64_t delta = 0;
+                    switch (series) {
+                        case HEAP: delta = e.type == format::ALLOC ? e.size : -e.size; break;
+                        case ALLOCS: delta = e.type == format::ALLOC; break;
+                        case FREES: delta = e.type == format::FREE; break;
+                        case ALLOCATED: delta = e.type == format::ALLOC ? e.size : 0; break;
+                    }
+                    if (delta == 0) {
+                        continue;
+                    }
+                    summary.advance(e.time / 1e9);
+                    if (values.size() <= e.scope) {
+                        values.resize(e.scope+1, 0);
+                    }
+                    values[e.scope] += delta;
+                    summary.set(e.scope, values[e.scope]);
+                }
+            } else {
+                throw std::runtime_error("bad record type");
+            }
+        }
+    }
+
+    // the CSV files are named after the inputs, without their directory;
+    // inputs with the same name (e.g. job1/memory_timeline.txt.gz and
+    // job2/memory_timeline.txt.gz) get their position on the command line
+    // appended, so that no two conversions write the same file
+    std::vector<std::string>
+    csv_names(const Options& options, const std::vector<std::string>& files)
+    {
+        std::vector<std::string> names;
+        std::unordered_map<std::string, size_t> count;
+        for(auto& filename : files) {
+            std::string name = filename.substr(filename.rfind('/')+1);
+            if (name.size() > 3 && name.compare(name.size()-3, 3, ".gz") == 0) {
+                name.resize(name.size()-3);
+            }
+            count[name]++;
+            names.push_back(std::move(name));
+        }
+        for(size_t i=0;i<names.size();i++) {
+            if (count[names[i]] > 1) {
+                names[i] += "." + std::to_string(i+1);
+            }
+            names[i] = options.csv_dir + "/" + names[i] + ".csv";
+        }
+        return names;
+    }
+
+    void
+    summarize(const std::string& filename, const std::string& csv_filename,
+              const Options& options, Report& report)
+    {
+        report.filename = filename;
+        try {
+            Input in(filename);
+            std::unique_ptr<CsvWriter> csv;
+            if (!csv_filename.empty()) {
+                csv = std::make_unique<CsvWriter>(csv_filename);
+            }
+            Summary summary(options, report, csv.get());
+            try {
+                if (in.ensure(4) && memcmp(in.pos, format::MAGIC, 4) == 0) {
+                    report.format = "binary";
+                    read_binary(in, options, summary, report);
+                } else if (in.ensure(4) && memcmp(in.pos, format::EVENT_MAGIC, 4) == 0) {
+                    report.format = "events";
+                    read_events(in, options, summary, report);
+                } else {
+                    report.format = "text";
+                    read_text(in, options, summary, report);
+                }
+            } catch (Truncated&) {
+                report.truncated = true;
+            }
+            report.truncated |= in.truncated;
+            summary.finish();
+        } catch (std::exception& e) {
+            report.error = e.what();
+        }
+    }
+
+
+    void
+    appendf(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    void
+    appendf(std::string& out, const char* fmt, ...)
+    {
+        char buf[512];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        if (n >= static_cast<int>(sizeof(buf))) {
+            std::vector<char> big(n+1);
+            va_start(args, fmt);
+            vsnprintf(big.data(), big.size(), fmt, args);
+            va_end(args);
+            out.append(big.data(), n);
+        } else if (n > 0) {
+            out.append(buf, n);
+        }
+    }
+
+    void
+    format_rows(const std::vector<Row>& rows, size_t limit, const char* indent, std::string& out)
+    {
+        limit = std::min(limit, rows.size());
+        int width = 5;
+        for(size_t i=0;i<limit;i++) {
+            width = std::max(width, static_cast<int>(rows[i].scope.size()));
+        }
+        width = std::min(width, 60);
+        appendf(out, "%s%-*s %15s %15s %15s\n", indent, width, "scope", "peak", "average", "final");
+        for(size_t i=0;i<limit;i++) {
+            auto& r = rows[i];
+            appendf(out, "%s%-*s %15lld %15.0f %15lld\n", indent, width, r.scope.c_str(),
+                    static_cast<long long>(r.peak), r.average, static_cast<long long>(r.final));
+        }
+    }
+
+    std::string
+    format_report(const Report& report, const Options& options)
+    {
+        std::string out;
+        appendf(out, "%s: %s, %llu %s over %.3f s, %zu scopes, series %s%s\n",
+                report.filename.c_str(), report.format.c_str(),
+                static_cast<unsigned long long>(report.records),
+                report.format == "events" ? "events" : "snapshots",
+                report.duration, report.scopes, options.series.c_str(),
+                report.truncated ? " (truncated)" : "");
+        format_rows(report.rows, options.top, "  ", out);
+        for(auto& w : report.windows) {
+            appendf(out, "  window %.3f s - %.3f s:\n", w.start, w.end);
+            format_rows(w.top, options.top, "    ", out);
+        }
+        return out;
+    }
+
+    void
+    summary_csv_rows(const Report& report, FILE* f)
+    {
+        std::string file = CsvWriter::quote(report.filename);
+        for(auto& r : report.rows) {
+            fprintf(f, "%s,all,%s,%lld,%.0f,%lld\n", file.c_str(), CsvWriter::quote(r.scope).c_str(),
+                    static_cast<long long>(r.peak), r.average, static_cast<long long>(r.final));
+        }
+        for(auto& w : report.windows) {
+            for(auto& r : w.top) {
+                fprintf(f, "%s,%.3f,%s,%lld,%.0f,%lld\n", file.c_str(), w.start,
+                        CsvWriter::quote(r.scope).c_str(), static_cast<long long>(r.peak),
+                        r.average, static_cast<long long>(r.final));
+            }
+        }
+    }
+
+    void
+    usage(const char* name)
+    {
+        fprintf(stderr,
+            "usage: %s [options] file...\n"
+            "\n"
+            "Summarize mem-scope-track timelines (text or binary) and event files,\n"
+            "optionally gzipped: the peak, time-averaged and final value of the top\n"
+            "scopes.\n"
+            "\n"
+            "  -s, --series NAME       series to summarize: heap (default), mapped, peak,\n"
+            "                          allocs, frees, allocated or size<N>\n"
+            "  -n, --top N             scopes to list (default 10)\n"
+            "  -w, --window SECONDS    also summarize each window of this length\n"
+            "  -c, --csv DIR           convert each file to DIR/<name>.csv, with a row\n"
+            "                          (seconds,scope,value) per change of a value;\n"
+            "                          files with the same name get DIR/<name>.<N>.csv,\n"
+            "                          N being their position among the files\n"
+            "  -S, --summary-csv FILE  write all summaries to one CSV file, with every\n"
+            "                          scope of each file and the top ones per window\n"
+            "  -j, --jobs N            files to read at once (default: one per CPU)\n",
+            name);
+    }
+
+} // end namespace
+
+
+int main(int argc, char** argv)
+{
+    Options options;
+    static const struct option long_options[] = {
+        {"series", required_argument, nullptr, 's'},
+        {"top", required_argument, nullptr, 'n'},
+        {"window", required_argument, nullptr, 'w'},
+        {"csv", required_argument, nullptr, 'c'},
+        {"summary-csv", required_argument, nullptr, 'S'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "s:n:w:c:S:j:h", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 's': options.series = optarg; break;
+            case 'n': options.top = strtoull(optarg, nullptr, 10); break;
+            case 'w': options.window = strtod(optarg, nullptr); break;
+            case 'c': options.csv_dir = optarg; break;
+            case 'S': options.summary_csv = optarg; break;
+            case 'j': options.jobs = strtoul(optarg, nullptr, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    std::vector<std::string> files(argv+optind, argv+argc);
+    if (files.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+    try {
+        series_kind(options.series);
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 2;
+    }
+
+    FILE* summary_csv = nullptr;
+    if (!options.summary_csv.empty()) {
+        summary_csv = fopen(options.summary_csv.c_str(), "w");
+        if (summary_csv == nullptr) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], options.summary_csv.c_str(), strerror(errno));
+            return 1;
+        }
+        fputs("file,window,scope,peak,average,final\n", summary_csv);
+    }
+
+    std::vector<std::string> csv_files;
+    if (!options.csv_dir.empty()) {
+        csv_files = csv_names(options, files);
+    }
+
+    // files are summarized in parallel, and reported in order as soon as
+    // all the ones before them are done
+    std::vector<std::unique_ptr<Report>> reports(files.size());
+    std::mutex mutex;
+    size_t reported = 0;
+    bool failed = false;
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for(size_t i; (i = next++) < files.size();) {
+            auto report = std::make_unique<Report>();
+            summarize(files[i], csv_files.empty() ? std::string() : csv_files[i],
+                      options, *report);
+            std::lock_guard<std::mutex> lock(mutex);
+            reports[i] = std::move(report);
+            for(; reported < files.size() && reports[reported]; reported++) {
+                auto& r = *reports[reported];
+                if (!r.error.empty()) {
+                    fflush(stdout);
+                    fprintf(stderr, "%s: %s: %s\n", argv[0], r.filename.c_str(), r.error.c_str());
+                    failed = true;
+                } else {
+                    fputs(format_report(r, options).c_str(), stdout);
+                    if (summary_csv != nullptr) {
+                        summary_csv_rows(r, summary_csv);
+                    }
+                }
+                reports[reported].reset();
+            }
+        }
+    };
+
+    unsigned jobs = options.jobs ? options.jobs : std::thread::hardware_concurrency();
+    jobs = std::max(1u, std::min<unsigned>(jobs, files.size()));
+    std::vector<std::thread> threads;
+    for(unsigned i=1;i<jobs;i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    if (summary_csv != nullptr) {
+        fclose(summary_csv);
+    }
+    return failed ? 1 : 0;
+}
@@ -2,4 +2,11 @@
 
 namespace memory {
     void set_scope(std::string s) { }
-}
\ No newline at end of file
+    void set_scope(const char* s) { }
+    void set_scope(ScopeHandle h) { }
+    ScopeHandle get_scope_handle(const char* s) { return ScopeHandle{0}; }
+    ScopeHandle get_scope() { return ScopeHandle{0}; }
+    void push_scope(const char* s) { }
+    void pop_scope() { }
+    void set_scope_budget(const char* s, size_t budget, BudgetCallback callback, void* arg) { }
+}
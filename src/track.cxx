@@ -1,6 +1,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <cerrno>
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
@@ -11,58 +13,127 @@
 #include <condition_variable>
 #include <chrono>
 #include <random>
+#include <cmath>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#include <cxxabi.h>
+#include <array>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <map>
+#include <cstdint>
 
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
 #include <boost/filesystem.hpp>
+#include <zlib.h>
 
 #include "track.h"
+#include "format.h"
+#include "arena.h"
 
 namespace {
 
+    // marks the calling thread as running tracker code, which also sends
+    // its allocations to the arena
     class RecursionGuard
     {
     public:
-        RecursionGuard() : recursion(false)
+        RecursionGuard() : recursion(memory::context.in_tracker)
         {
-            recursion = recursion_guard_.test_and_set(std::memory_order_acquire);
+            memory::context.in_tracker = true;
         }
         ~RecursionGuard() {
             if (!recursion) {
-                recursion_guard_.clear(std::memory_order_release);
+                memory::context.in_tracker = false;
             }
         }
         bool recursion;
-    private:
-        static thread_local std::atomic_flag recursion_guard_;
     };
-    thread_local std::atomic_flag RecursionGuard::recursion_guard_ = ATOMIC_FLAG_INIT;
     static std::atomic<bool> tracking_enabled(false);
 
+    // Output names of this process. A forked child, or an exec'd one with
+    // MEMSCOPETRACK_FOLLOW_EXEC, writes to "<name>.<pid>" instead, before
+    // a ".gz" suffix, so a whole process tree can be tracked at once.
+    static char process_suffix[24] = "";
+
+    std::string
+    process_path(const std::string& name)
+    {
+        if (process_suffix[0] == '\0') {
+            return name;
+        }
+        if (name.size() > 3 && name.compare(name.size()-3, 3, ".gz") == 0) {
+            return name.substr(0, name.size()-3) + process_suffix + ".gz";
+        }
+        return name + process_suffix;
+    }
+
 
-    // create an output file
+    // create an output file, gzipped if the name ends in .gz
+    //
+    // Writes only append to a buffer. A writer thread swaps it for a
+    // second one, and compresses and writes out the full one while the
+    // next fills up. Every MEMSCOPETRACK_FLUSH seconds everything so far
+    // is written out and the gzip member is ended, so the file is
+    // readable up to then even if the process never exits cleanly.
     class Outfile
     {
     public:
         Outfile() = delete;
         Outfile(std::string);
-        ~Outfile() = default;
+        ~Outfile();
 
-        // non-copyable, movable
+        // non-copyable, non-movable: the writer thread refers to it
         Outfile(const Outfile&) = delete;
-        Outfile(Outfile&&) = default;
         Outfile& operator=(const Outfile&) = delete;
-        Outfile& operator=(Outfile&&) = default;
 
-        template<typename T>
-        std::ostream& operator<<(T);
+        // write raw bytes; a no-op if the file could not be opened
+        void write(const char*, size_t);
+
+        // false if the file could not be opened, in which case nothing
+        // is ever written
+        inline bool is_open() const { return fd_ >= 0; }
 
         inline std::string get_filename() const { return filename_; }
     private:
+        // wake the writer at this much buffered output
+        static constexpr size_t BLOCK = 256*1024;
+        // past this much, writes wait for the writer
+        static constexpr size_t MAX_BUFFERED = 64*1024*1024;
+
+        void run();
+
+        // compress and write out a buffer; flush ends the gzip member,
+        // and last ends the file
+        void deliver(const std::string&, bool flush, bool last);
+        void write_fd(const char*, size_t);
+
         std::string filename_;
-        std::unique_ptr<std::ofstream> outfile_base_;
-        std::unique_ptr<boost::iostreams::filtering_ostreambuf> out_filter_;
-        std::unique_ptr<std::ostream> outfile_stream_;
+        int fd_;
+        std::unique_ptr<z_stream> zstream_;  // null for plain files
+        bool member_open_;                   // input since the member started
+        bool any_member_;
+        std::string compressed_;
+        std::chrono::milliseconds flush_interval_;
+
+        std::string front_;                  // filled by write
+        std::string back_;                   // being written out
+        bool closing_;
+        std::mutex mutex_;
+        std::condition_variable cv_;         // for the writer
+        std::condition_variable room_cv_;    // for writes waiting on the writer
+        std::unique_ptr<std::thread> thread_;
     };
 
     // get a randomly named output file in the current directory
@@ -71,18 +142,86 @@ namespace {
     public:
         RandomOutfile();
         ~RandomOutfile() = default;
+    };
+
+    // one sample of the per-scope totals, each series indexed by scope id
+    struct Snapshot
+    {
+        struct Series
+        {
+            uint64_t kind;  // one of the format.h series kinds
+            std::vector<size_t> values;
+        };
+
+        uint64_t usec = 0;  // time since the start of tracking
+        std::vector<size_t> heap;
+        std::vector<Series> series;
+    };
+
+    // write snapshots of the scope totals to an output file
+    class SnapshotWriter
+    {
+    public:
+        virtual ~SnapshotWriter() = default;
+
+        // write a snapshot; names must cover every id in it
+        virtual void write(const Snapshot&, const std::vector<std::string>& names) = 0;
+    };
+
+    // the text format described in format.h
+    class TextWriter : public SnapshotWriter
+    {
+    public:
+        TextWriter(Outfile& out) : out_(out) { }
+        void write(const Snapshot&, const std::vector<std::string>&) override;
+    private:
+        Outfile& out_;
+        std::string buf_;
+        std::map<uint64_t, std::vector<size_t>> previous_series_;
+    };
 
-        // non-copyable, movable
-        RandomOutfile(const RandomOutfile&) = delete;
-        RandomOutfile(RandomOutfile&&) = default;
+    // append a snapshot in the text format to a string. With previous,
+    // only the series values that changed since then are written, and
+    // previous is updated; without, the non-zero ones.
+    void format_text(const Snapshot&, const std::vector<std::string>&, std::string&,
+                     std::map<uint64_t, std::vector<size_t>>* previous = nullptr);
+
+    // the binary format described in format.h
+    class BinaryWriter : public SnapshotWriter
+    {
+    public:
+        BinaryWriter(Outfile&);
+        void write(const Snapshot&, const std::vector<std::string>&) override;
+    private:
+        // append the changes from previous to values, updating previous
+        void put_changes(const std::vector<size_t>& values, std::vector<size_t>& previous);
+
+        Outfile& out_;
+        std::string buf_;
+        std::vector<size_t> previous_;
+        std::map<uint64_t, std::vector<size_t>> previous_series_;
+        size_t defined_ = 1; // scope 0 is never written
+        uint64_t previous_usec_ = 0;
     };
 
+    // pick the writer selected by MEMSCOPETRACK_FORMAT
+    std::unique_ptr<SnapshotWriter> make_writer(Outfile&);
+
+
+    // most verbose log level compiled in, see CMakeLists.txt
+    #ifndef MEMSCOPETRACK_MAX_LOG_LEVEL
+    #define MEMSCOPETRACK_MAX_LOG_LEVEL 3
+    #endif
+
     // log output to none, stdout, stderr, or file
     class Log {
     private:
         enum class DEST { none, stdout, stderr, file };
     public:
-        Log() : out_(DEST::none)
+        // message levels, from MEMSCOPETRACK_LOGLEVEL (default info)
+        enum class LEVEL : int { error = 0, warn = 1, info = 2, debug = 3 };
+
+        Log() : out_(DEST::none), level_(LEVEL::info)
         {
             char* filename = std::getenv("MEMSCOPETRACK_LOGFILE");
             if (filename != nullptr) {
@@ -91,364 +230,3653 @@ namespace {
                 } else if (strncmp(filename,"stderr",6) == 0) {
                     out_ = DEST::stderr;
                 } else {
-                    logfile_ = std::make_unique<Outfile>(filename);
-                    out_ = DEST::file;
+                    filename_ = filename;
+                    open_logfile();
+                }
+            }
+            char* level = std::getenv("MEMSCOPETRACK_LOGLEVEL");
+            if (level != nullptr) {
+                if (strcmp(level,"error") == 0) {
+                    level_ = LEVEL::error;
+                } else if (strcmp(level,"warn") == 0) {
+                    level_ = LEVEL::warn;
+                } else if (strcmp(level,"info") == 0) {
+                    level_ = LEVEL::info;
+                } else if (strcmp(level,"debug") == 0) {
+                    level_ = LEVEL::debug;
                 }
             }
+            // nowhere to write, so skip formatting at every level
+            verbosity_ = out_ == DEST::none ? -1 : static_cast<int>(level_);
         }
         ~Log() {
             // necessary so we don't try to log messages after this point
             tracking_enabled = false;
         }
 
-        template<typename ...Ts>
-        void print(Ts... args) {
+        // true if a message at level L would be written. Levels above
+        // MEMSCOPETRACK_MAX_LOG_LEVEL are false at compile time, so the
+        // whole call compiles away.
+        template<LEVEL L>
+        inline bool enabled() const {
+            return static_cast<int>(L) <= MEMSCOPETRACK_MAX_LOG_LEVEL
+                   && static_cast<int>(L) <= verbosity_;
+        }
+
+        // printf-style, so that -Wformat checks every message. Not
+        // inlined, being variadic: on hot paths, check enabled<L>() first.
+        template<LEVEL L>
+        __attribute__((format(printf, 2, 3)))
+        void print(const char* fmt, ...) {
+            if (enabled<L>()) {
+                va_list args;
+                va_start(args, fmt);
+                write(fmt, args);
+                va_end(args);
+            }
+        }
+
+        // in a forked child: the writer thread of the log file is gone,
+        // so leave it to the parent and open the child's own
+        void after_fork() {
+            if (logfile_) {
+                logfile_.release();
+                open_logfile();
+            }
+        }
+    private:
+        // log to the file, or to stderr if it cannot be opened
+        void open_logfile() {
+            logfile_ = std::make_unique<Outfile>(process_path(filename_));
+            if (logfile_->is_open()) {
+                out_ = DEST::file;
+            } else {
+                logfile_.reset();
+                out_ = DEST::stderr;
+            }
+        }
+
+        __attribute__((format(printf, 2, 0)))
+        void write(const char* fmt, va_list args) {
             if (out_ == DEST::file && logfile_) {
                 char buf[1024];
-                snprintf(buf, 1024, args...);
-                *logfile_ << buf;
+                int n = vsnprintf(buf, 1024, fmt, args);
+                if (n > 0) {
+                    logfile_->write(buf, std::min(n, 1023));
+                }
             } else if (out_ == DEST::stdout) {
-                fprintf(stdout, args...);
+                vfprintf(stdout, fmt, args);
             } else if (out_ == DEST::stderr) {
-                fprintf(stderr, args...);
+                vfprintf(stderr, fmt, args);
             } // else, ignore
         }
-    private:
+
+        std::string filename_;
         std::unique_ptr<Outfile> logfile_;
         DEST out_;
+        LEVEL level_;
+        int verbosity_;
     };
 
 
-    class Tracking;
-
-    class TrackingThread
+    // scope names interned once, referred to everywhere else by a small
+    // integer id. Id 0 is reserved for the empty (untracked) scope.
+    // Names are paths: "a/b/c" is a child of "a/b", which is interned
+    // along with it, and top-level names have parent 0.
+    class ScopeRegistry
     {
     public:
-        TrackingThread() = delete;
-        TrackingThread(const Tracking&);
-        ~TrackingThread();
+        ScopeRegistry();
+        ~ScopeRegistry() = default;
 
         // non-copyable, non-movable
-        TrackingThread(const TrackingThread&) = delete;
-        TrackingThread(TrackingThread&&) = delete;
-        TrackingThread& operator=(const TrackingThread&) = delete;
-        TrackingThread& operator=(TrackingThread&&) = delete;
-    private:
-        void run();
-
-        std::atomic<bool> running_;
-        const Tracking& tracking_;
-        std::unique_ptr<std::thread> tracking_thread_;
-        std::condition_variable tracking_thread_cv_;
-        std::mutex tracking_thread_cv_mutex_;
-    };
+        ScopeRegistry(const ScopeRegistry&) = delete;
+        ScopeRegistry(ScopeRegistry&&) = delete;
+        ScopeRegistry& operator=(const ScopeRegistry&) = delete;
+        ScopeRegistry& operator=(ScopeRegistry&&) = delete;
 
+        // get the id for a name, adding it if necessary; a name that is not
+        // a path is always a top-level node
+        uint32_t intern(const std::string&, bool path = true);
 
-    class Tracking
-    {
-    public:
-        Tracking() = delete;
-        Tracking(std::shared_ptr<Log>);
-        ~Tracking();
+        // get the id of a child of a scope, adding it if necessary
+        uint32_t child(uint32_t, const std::string&);
 
-        // non-copyable, non-movable
-        Tracking(const Tracking&) = delete;
-        Tracking(Tracking&&) = delete;
-        Tracking& operator=(const Tracking&) = delete;
-        Tracking& operator=(Tracking&&) = delete;
+        // get the parent of an id
+        uint32_t parent(uint32_t) const;
 
-        // start tracking to file
-        void start();
+        // get the parents of ids starting at the given id
+        std::vector<uint32_t> parents(uint32_t) const;
 
-        // stop tracking to file
-        void stop();
+        // get the name for an id
+        std::string name(uint32_t) const;
 
-        // add memory at address with scope and size
-        void add(void*, std::string, size_t);
+        // get the name for an id, valid for the lifetime of the registry
+        const char* c_str(uint32_t) const;
 
-        // remove memory at address
-        void remove(void*);
+        // get the names of ids starting at the given id
+        std::vector<std::string> names(uint32_t) const;
 
-        // get current scope map as a copy
-        std::unordered_map<std::string, size_t> get_extents() const;
+        // number of ids handed out, including the empty scope
+        size_t size() const;
 
-        // get library path
-        inline std::string get_library_path() const
-        { return library_path_; }
+        // held across fork, so that the child gets a consistent copy
+        inline void lock() { guard_.lock(); }
+        inline void unlock() { guard_.unlock(); }
 
     private:
-        std::shared_ptr<Log> log_;
-        std::string library_path_;
-        std::unordered_map<std::string, size_t> scope_map_;
-        std::unordered_map<void*, std::pair<std::string, size_t>> ptr_map_;
-        mutable std::mutex thread_guard_;
-        std::unique_ptr<TrackingThread> tracking_thread_;
-    };
+        uint32_t intern_locked(const std::string&, bool);
 
+        std::unordered_map<std::string, uint32_t> ids_;
+        std::deque<std::string> names_;
+        std::vector<uint32_t> parents_;
+        mutable std::mutex guard_;
+    };
 
-    /** Implementation **/
 
-    Outfile::Outfile(std::string path)
-        : filename_(path)
+    // address -> (scope,size) table, split into independently locked shards
+    // so that threads allocating at the same time rarely touch the same lock
+    class AddressTable
     {
-        auto has_suffix = [&](const std::string &suffix)
+    public:
+        // what a block's age is counted in, see Tracking::tick
+        static constexpr unsigned TICKS_PER_SECOND = 16;
+        static constexpr uint64_t MAX_BIRTH = (uint64_t(1) << 24) - 1;
+
+        // packed into 16 bytes, as there can be tens of millions
+        struct Entry
         {
-            return filename_.size() >= suffix.size() &&
-                   filename_.compare(filename_.size() - suffix.size(), suffix.size(), suffix) == 0;
+            uint64_t size : 40;
+            uint64_t birth : 24;    // ticks since the start, saturating
+            uint32_t scope;
+            uint16_t thread;    // Breakdown keys, with MEMSCOPETRACK_BREAKDOWN
+            uint16_t node;
         };
-        outfile_base_ = std::make_unique<std::ofstream>(filename_, std::ios::out | std::ios::binary);
-        if (!outfile_base_) {
-            throw std::runtime_error("cannot open output file");
-        }
-        if (has_suffix(".gz")) {
-            // gzip the file
-            out_filter_ = std::make_unique<boost::iostreams::filtering_ostreambuf>();
-            out_filter_->push(boost::iostreams::gzip_compressor());
-            out_filter_->push(*outfile_base_);
-            outfile_stream_ = std::make_unique<std::ostream>(out_filter_.get());
-        } else {
-            // plain file
-            outfile_stream_ = std::move(outfile_base_);
+        static_assert(sizeof(Entry) == 16, "entries stay small");
+
+        AddressTable() = default;
+        ~AddressTable() = default;
+
+        // non-copyable, non-movable
+        AddressTable(const AddressTable&) = delete;
+        AddressTable(AddressTable&&) = delete;
+        AddressTable& operator=(const AddressTable&) = delete;
+        AddressTable& operator=(AddressTable&&) = delete;
+
+        // insert an entry, or return false and copy out the existing one
+        bool insert(void*, const Entry&, Entry&);
+
+        // remove an entry, returning false if it was not present
+        bool erase(void*, Entry&);
+
+        // held across fork, so that the child gets a consistent copy
+        void lock();
+        void unlock();
+
+        // call f(worker, entry) on every entry, with the shards shared
+        // out among this many threads, the calling one included
+        template<typename F>
+        void for_each_parallel(unsigned workers, F f)
+        {
+            std::atomic<size_t> next{0};
+            auto work = [&](unsigned worker) {
+                // what workers allocate is the tracker's, like the caller's
+                RecursionGuard r;
+                for(size_t i=next++; i<NUM_SHARDS; i=next++) {
+                    std::lock_guard<std::mutex> lock(shards_[i].lock);
+                    for(auto& e : shards_[i].map) {
+                        f(worker, e.second);
+                    }
+                }
+            };
+            std::vector<std::thread> threads;
+            for(unsigned w=1;w<workers;w++) {
+                threads.emplace_back(work, w);
+            }
+            work(0);
+            for(auto& t : threads) {
+                t.join();
+            }
         }
-    }
 
-    std::string randstr(unsigned length)
-    {
-        auto randchar = []() -> char
+    private:
+        static constexpr size_t SHARD_BITS = 6;
+        static constexpr size_t NUM_SHARDS = size_t(1) << SHARD_BITS;
+
+        struct Shard
         {
-            const char charset[] =
-            "0123456789"
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-            "abcdefghijklmnopqrstuvwxyz";
-            const size_t max_index = (sizeof(charset) - 2);
-            std::mt19937 rng (std::random_device{}());
-            std::uniform_int_distribution<> dist (0, max_index);
-            return charset[ dist(rng) ];
+            std::mutex lock;
+            std::unordered_map<void*, Entry> map;
+            // entries in map, so frees of untracked blocks can skip
+            // empty shards without taking the lock
+            std::atomic<size_t> size{0};
+            // keep neighbouring shard locks on separate cache lines
+            char padding[64];
         };
 
-        std::string ret;
-        for(unsigned i=0;i<length;i++) {
-            ret.push_back(randchar());
+        static inline size_t shard_index(void* addr)
+        {
+            // malloc returns 16-byte aligned pointers, so mix the high bits in
+            uint64_t x = reinterpret_cast<uintptr_t>(addr) >> 4;
+            x *= 0x9E3779B97F4A7C15ull;
+            return static_cast<size_t>(x >> (64 - SHARD_BITS));
         }
-        return ret;
-    }
 
-    RandomOutfile::RandomOutfile()
-        : Outfile("mem-scope-track."+randstr(10)+".gz")
-    { }
+        std::array<Shard, NUM_SHARDS> shards_;
+    };
+
 
-    template<typename T>
-    std::ostream&
-    Outfile::operator<<(T value)
+    // per-scope counters kept by each thread; bytes is a delta that may
+    // go negative when a thread frees more than it allocated
+    struct ScopeStats
     {
-        *outfile_stream_ << value;
-        return *outfile_stream_;
-    }
+        int64_t bytes = 0;
+        int64_t high = 0;   // highest bytes since the last snapshot
+        uint64_t allocs = 0;
+        uint64_t frees = 0;
+        uint64_t allocated = 0;
+        std::array<uint64_t, format::SIZE_CLASSES> sizes{};
+    };
 
+    // Scope id -> counter table owned by a single thread. Only the owner
+    // writes it, and the sampler reads it while allocations continue:
+    // counters live in fixed chunks that never move, the live bytes and
+    // peak of each scope are published under a per-scope sequence lock,
+    // and the running totals are plain relaxed atomics. Frees are recorded
+    // on the freeing thread, wherever the memory was allocated.
+    class EventRing;
 
-    TrackingThread::TrackingThread(const Tracking& t)
-        : running_(true), tracking_(t)
+    struct ThreadState
     {
-        tracking_thread_ = std::make_unique<std::thread>(&TrackingThread::run,this);
-    }
+        ThreadState() = default;
+        ~ThreadState();
 
-    TrackingThread::~TrackingThread()
-    {
-        running_ = false;
-        tracking_thread_cv_.notify_all();
-        tracking_thread_->join();
-    }
+        // non-copyable, non-movable
+        ThreadState(const ThreadState&) = delete;
+        ThreadState(ThreadState&&) = delete;
+        ThreadState& operator=(const ThreadState&) = delete;
+        ThreadState& operator=(ThreadState&&) = delete;
 
-    void TrackingThread::run()
-    {
-        RecursionGuard r;
-        boost::filesystem::path p = boost::filesystem::absolute(tracking_.get_library_path());
-        p = p.parent_path();
-        p /= "python";
-        p /= "timeline.py";
-        std::string graph_cmd = "python " + p.string();
+        struct Counters
         {
-            using namespace std::chrono_literals;
-            auto start = std::chrono::high_resolution_clock::now();
-            std::unique_lock<std::mutex> lock(tracking_thread_cv_mutex_);
+            // odd while the owner is updating bytes, high and epoch
+            std::atomic<uint32_t> seq{0};
+            // peak interval that high belongs to
+            std::atomic<uint32_t> epoch{0};
+            std::atomic<int64_t> bytes{0};
+            std::atomic<int64_t> high{0};
+            // high of the interval before epoch, kept for a merge that
+            // has started the new interval but not read this scope yet
+            std::atomic<int64_t> last_high{0};
+            std::atomic<uint64_t> allocs{0};
+            std::atomic<uint64_t> frees{0};
+            std::atomic<uint64_t> allocated{0};
+            std::array<std::atomic<uint64_t>, format::SIZE_CLASSES> sizes{};
+            // bytes not yet added to the scope's Budget, owner only
+            int64_t budget = 0;
+        };
 
-            std::unique_ptr<Outfile> outfile;
-            char* outfile_name = std::getenv("MEMSCOPETRACK_OUTFILE");
-            if (outfile_name == nullptr) {
-                outfile = std::make_unique<RandomOutfile>();
-            } else {
-                outfile = std::make_unique<Outfile>(outfile_name);
-            }
-            graph_cmd += " " + outfile->get_filename();
+        static constexpr size_t CHUNK_BITS = 8;
+        static constexpr size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+        static constexpr size_t MAX_CHUNKS = 4096;
 
-            auto print = [&](){
-                auto extents = tracking_.get_extents();
-                auto now = std::chrono::high_resolution_clock::now();
-                *outfile << "---" << std::chrono::duration_cast<std::chrono::microseconds>(now-start).count() << "\n";
-                for(auto& pair: extents) {
-                    *outfile << pair.first << "|" << pair.second << "\n";
-                }
-            };
-            print();
+        struct Chunk
+        {
+            std::array<Counters, CHUNK_SIZE> scopes;
+        };
 
-            while(running_) {
-                tracking_thread_cv_.wait_for(lock, 100ms, [&](){return running_==false;});
-                print();
-            }
-        }
+        // serializes writers of the shared orphan state only
+        std::mutex lock;
+        bool in_use = false;
 
-        // call into python to make graph
-        std::cout << graph_cmd << "\n";
-        //system(graph_cmd);
-    }
-    
+        // true for the orphan state, which several threads may share
+        bool shared = false;
 
-    Tracking::Tracking(std::shared_ptr<Log> log)
-        : log_(log)
-    {
-        char* preload = std::getenv("LD_PRELOAD");
-        if (preload == nullptr) {
-            fprintf(stderr, "failed to initialize preload path\n");
-            abort();
-        }
-        boost::filesystem::path p(preload);
-        library_path_ = p.string();
+        // kernel id of the owning thread
+        uint32_t thread = 0;
 
-        // start the tracking file
-        start();
-    }
+        // Breakdown key of the owning thread, 0 until assigned
+        uint32_t origin = 0;
 
-    Tracking::~Tracking()
-    {
-        tracking_enabled = false;
-        stop();
-        bool empty = true;
-        for(auto& pair : scope_map_) {
-            if (pair.second != 0) {
-                empty = false;
-                break;
+        // current peak interval, owned by the ThreadStateList
+        const std::atomic<uint32_t>* epoch = nullptr;
+
+        // events pushed by the owner, created on first use
+        std::atomic<EventRing*> events{nullptr};
+
+        // sum of bytes over all scopes
+        std::atomic<int64_t> total{0};
+
+        std::array<std::atomic<Chunk*>, MAX_CHUNKS> chunks{};
+
+        // scopes beyond MAX_CHUNKS*CHUNK_SIZE land here and are not reported
+        Counters overflow;
+
+        inline Counters& get(uint32_t scope)
+        {
+            size_t index = scope >> CHUNK_BITS;
+            if (index >= MAX_CHUNKS) {
+                return overflow;
             }
-        }
-        if (!empty && log_) {
-            log_->print("Unfreed memory:\n");
-            for(auto& pair : scope_map_) {
-                if (pair.second != 0) {
-                    log_->print("  %s - %u\n", pair.first.c_str(), pair.second);
-                }
+            Chunk* chunk = chunks[index].load(std::memory_order_relaxed);
+            if (chunk == nullptr) {
+                chunk = new Chunk;
+                chunks[index].store(chunk, std::memory_order_release);
             }
+            return chunk->scopes[scope & (CHUNK_SIZE-1)];
         }
-    }
-
-    void
-    Tracking::start()
-    {
-        tracking_thread_ = std::make_unique<TrackingThread>(*this);
-    }
-
-    void
-    Tracking::stop()
-    {
-        tracking_thread_.reset();
-    }
 
-    void
-    Tracking::add(void* addr, std::string scope, size_t size)
-    {
-        std::lock_guard<std::mutex> lock(thread_guard_);
-        auto iter = ptr_map_.find(addr);
-        if (iter == ptr_map_.end()) {
-            ptr_map_.emplace(std::make_pair(addr, std::make_pair(scope,size)));
-            auto iter2 = scope_map_.find(scope);
-            if (iter2 == scope_map_.end()) {
-                scope_map_.emplace(std::make_pair(scope,size));
+        inline void alloc(uint32_t scope, size_t size)
+        {
+            if (shared) {
+                std::lock_guard<std::mutex> guard(lock);
+                alloc_owned(scope, size);
             } else {
-                iter2->second += size;
+                alloc_owned(scope, size);
             }
-        } else {
-            log_->print("duplicate memory address 0x%08x for %8u bytes in scope %s\n", addr, size, scope.c_str());
-            log_->print("    previous allocation:                %8u bytes in scope %s\n", iter->second.second, iter->second.first.c_str());
         }
-    }
 
-    void
-    Tracking::remove(void* addr)
-    {
-        std::lock_guard<std::mutex> lock(thread_guard_);
-        auto iter = ptr_map_.find(addr);
-        if (iter != ptr_map_.end()) {
-            auto scope = iter->second.first;
-            auto size = iter->second.second;
-            auto iter2 = scope_map_.find(scope);
-            if (iter2 != scope_map_.end()) {
-                if (iter2->second <= size) {
-                    iter2->second = 0;
-                } else {
-                    iter2->second -= size;
-                }
+        inline void free(uint32_t scope, size_t size)
+        {
+            if (shared) {
+                std::lock_guard<std::mutex> guard(lock);
+                free_owned(scope, size);
+            } else {
+                free_owned(scope, size);
             }
-            ptr_map_.erase(iter);
         }
-    }
 
-    
-    std::unordered_map<std::string, size_t>
-    Tracking::get_extents() const
-    {
-        std::lock_guard<std::mutex> lock(thread_guard_);
-        std::unordered_map<std::string, size_t> ret(scope_map_);
-        return ret;
-    }
+        // read a consistent copy of the counters of a scope
+        void read(const Counters&, ScopeStats&, uint32_t) const;
 
-} // end anon namespace
+    private:
+        template<typename T>
+        static inline void add(std::atomic<T>& a, T value)
+        {
+            // single writer, so no read-modify-write needed
+            a.store(a.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        // update bytes of a scope, starting a new peak interval if needed
+        inline void update(Counters& c, int64_t delta)
+        {
+            uint32_t e = epoch->load(std::memory_order_relaxed);
+            uint32_t seq = c.seq.load(std::memory_order_relaxed);
+            c.seq.store(seq+1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            int64_t bytes = c.bytes.load(std::memory_order_relaxed);
+            int64_t high = c.high.load(std::memory_order_relaxed);
+            uint32_t last = c.epoch.load(std::memory_order_relaxed);
+            if (last != e) {
+                // no update during the previous interval means bytes
+                // stayed the same
+                c.last_high.store(last == e-1 ? high : bytes, std::memory_order_relaxed);
+                c.epoch.store(e, std::memory_order_relaxed);
+                high = bytes;
+            }
+            bytes += delta;
+            if (bytes > high) {
+                high = bytes;
+            }
+            c.bytes.store(bytes, std::memory_order_relaxed);
+            c.high.store(high, std::memory_order_relaxed);
+            c.seq.store(seq+2, std::memory_order_release);
+        }
+
+        inline void alloc_owned(uint32_t scope, size_t size)
+        {
+            Counters& c = get(scope);
+            update(c, size);
+            add<uint64_t>(c.allocs, 1);
+            add<uint64_t>(c.allocated, size);
+            add<uint64_t>(c.sizes[format::size_class(size)], 1);
+            add<int64_t>(total, size);
+        }
+
+        inline void free_owned(uint32_t scope, size_t size)
+        {
+            Counters& c = get(scope);
+            update(c, -static_cast<int64_t>(size));
+            add<uint64_t>(c.frees, 1);
+            add<int64_t>(total, -static_cast<int64_t>(size));
+        }
+    };
+
+    // all thread tables ever created; tables of exited threads are
+    // kept (their counters are still part of the totals) and handed out
+    // again to new threads
+    class ThreadStateList
+    {
+    public:
+        ThreadStateList();
+        ~ThreadStateList() = default;
+
+        // non-copyable, non-movable
+        ThreadStateList(const ThreadStateList&) = delete;
+        ThreadStateList(ThreadStateList&&) = delete;
+        ThreadStateList& operator=(const ThreadStateList&) = delete;
+        ThreadStateList& operator=(ThreadStateList&&) = delete;
+
+        // get the table of the calling thread
+        ThreadState& local();
+
+        // sum the counters of all tables, indexed by scope id, and
+        // optionally start a new high-water interval. Writers are not
+        // blocked, only new threads.
+        std::vector<ScopeStats> merge(bool reset_high = false) const;
+
+        // total heap bytes of all scopes, without locking any table
+        size_t total() const;
+
+        // held across fork, so that the child gets a consistent copy
+        void lock();
+        void unlock();
+
+        // in a forked child: hand out the tables of the threads that did
+        // not survive the fork again, keeping their counts
+        void after_fork();
+
+        // call a function on every table, blocking new threads meanwhile
+        template<typename F>
+        void for_each(F f) const
+        {
+            std::lock_guard<std::mutex> lock(tables_guard_);
+            for(auto& t : tables_) {
+                f(*t);
+            }
+        }
+
+    private:
+        ThreadState& acquire();
+        void release(ThreadState&);
+
+        // shared table for threads that are already past their
+        // thread-local destructors
+        ThreadState* orphan_;
+        std::vector<std::unique_ptr<ThreadState>> tables_;
+        mutable std::atomic<uint32_t> epoch_{1};
+        mutable std::mutex tables_guard_;
+
+        static thread_local ThreadState* local_;
+        static thread_local bool exited_;
+    };
+    thread_local ThreadState* ThreadStateList::local_ = nullptr;
+    thread_local bool ThreadStateList::exited_ = false;
+
+
+    // Live heap bytes by scope and by a small key: the allocating thread
+    // or NUMA node. Frees are taken off the key of the allocation, which
+    // may be another thread's, so cells are updated atomically.
+    class Breakdown
+    {
+    public:
+        static constexpr size_t MAX_KEYS = 1024;
+
+        Breakdown() = default;
+        ~Breakdown();
+
+        // non-copyable, non-movable
+        Breakdown(const Breakdown&) = delete;
+        Breakdown(Breakdown&&) = delete;
+        Breakdown& operator=(const Breakdown&) = delete;
+        Breakdown& operator=(Breakdown&&) = delete;
+
+        inline void add(uint32_t key, uint32_t scope, int64_t delta)
+        {
+            cell(key, scope).fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        // bytes by scope of each key that has any, or had any at the
+        // previous call with advance set, so that readers see a key go
+        // back to zero
+        std::vector<std::pair<uint32_t, std::vector<size_t>>> collect(size_t scopes, bool advance);
+
+        // held across fork, so that the child gets a consistent copy
+        inline void lock() { collect_guard_.lock(); }
+        inline void unlock() { collect_guard_.unlock(); }
+
+    private:
+        using Chunk = std::array<std::atomic<int64_t>, ThreadState::CHUNK_SIZE>;
+        struct Column
+        {
+            std::array<std::atomic<Chunk*>, ThreadState::MAX_CHUNKS> chunks{};
+            bool reported = false;
+        };
+
+        std::atomic<int64_t>& cell(uint32_t key, uint32_t scope);
+
+        std::array<std::atomic<Column*>, MAX_KEYS> columns_{};
+        // scopes beyond the chunks land here and are not reported
+        std::atomic<int64_t> overflow_{0};
+        std::mutex collect_guard_;
+    };
+
+
+    // Single-producer single-consumer ring of events. The owning thread
+    // pushes without locking or formatting anything, and the event writer
+    // thread pops in batches.
+    class EventRing
+    {
+    public:
+        explicit EventRing(size_t);
+        ~EventRing() = default;
+
+        // non-copyable, non-movable
+        EventRing(const EventRing&) = delete;
+        EventRing(EventRing&&) = delete;
+        EventRing& operator=(const EventRing&) = delete;
+        EventRing& operator=(EventRing&&) = delete;
+
+        // add an event, returning false if the ring is full
+        inline bool push(const format::Event& e)
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head - tail_.load(std::memory_order_acquire) > mask_) {
+                return false;
+            }
+            buf_[head & mask_] = e;
+            head_.store(head+1, std::memory_order_release);
+            return true;
+        }
+
+        // move all available events to the end of out
+        void pop(std::vector<format::Event>& out);
+
+        // drop all events, with no other thread using the ring
+        inline void clear()
+        {
+            tail_.store(head_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            dropped.store(0, std::memory_order_relaxed);
+        }
+
+        // events the owner could not push, updated only by the owner
+        std::atomic<uint64_t> dropped{0};
+
+    private:
+        std::unique_ptr<format::Event[]> buf_;
+        size_t mask_;
+        std::atomic<size_t> head_{0};
+        // keep producer and consumer indices on separate cache lines
+        char padding_[64];
+        std::atomic<size_t> tail_{0};
+    };
+
+
+    class ScopeRegistry;
+
+    // Records the full allocation event stream when MEMSCOPETRACK_EVENTS
+    // is set. Allocating threads push into their own EventRing, and a
+    // background thread drains all rings to the event file.
+    class EventRecorder
+    {
+    public:
+        EventRecorder() = delete;
+        EventRecorder(std::string, const ThreadStateList&, const ScopeRegistry&);
+        ~EventRecorder();
+
+        // non-copyable, non-movable
+        EventRecorder(const EventRecorder&) = delete;
+        EventRecorder(EventRecorder&&) = delete;
+        EventRecorder& operator=(const EventRecorder&) = delete;
+        EventRecorder& operator=(EventRecorder&&) = delete;
+
+        // record an event in the calling thread's ring
+        void record(ThreadState&, uint8_t, void*, uint32_t, size_t);
+
+    private:
+        void run();
+        void drain(std::vector<format::Event>&);
+
+        const ThreadStateList& threads_;
+        const ScopeRegistry& scopes_;
+        std::unique_ptr<Outfile> outfile_;
+        size_t capacity_;
+        bool block_;
+        size_t defined_ = 1; // scope 0 is never written
+        std::chrono::steady_clock::time_point start_;
+
+        std::atomic<bool> running_;
+        std::unique_ptr<std::thread> thread_;
+        std::condition_variable cv_;
+        std::mutex cv_mutex_;
+    };
+
+
+    // Byte-based Poisson sampler, in the style of the tcmalloc and jemalloc
+    // heap profiles. Every byte has the same chance of being picked, and an
+    // allocation is sampled when one of its bytes is. A sampled allocation
+    // is reported with its size scaled by the inverse of that probability.
+    class Sampler
+    {
+    public:
+        // get the scaled size if the allocation is sampled, otherwise 0
+        inline size_t sample(size_t size, size_t mean)
+        {
+            if (left_ > size) {
+                left_ -= size;
+                return 0;
+            }
+            return sample_slow(size, mean);
+        }
+    private:
+        size_t sample_slow(size_t, size_t);
+        size_t next_interval(size_t);
+
+        uint64_t state_ = 0;
+        size_t left_ = 0;
+    };
+
+
+    // Call stacks of allocations made outside any scope, deduplicated and
+    // named after the functions on them, so each distinct stack becomes a
+    // synthetic "stack:outer;...;inner" scope.
+    class StackTable
+    {
+    public:
+        static constexpr int MAX_DEPTH = 16;
+
+        StackTable(ScopeRegistry& scopes) : scopes_(scopes) { }
+        ~StackTable() = default;
+
+        // non-copyable, non-movable
+        StackTable(const StackTable&) = delete;
+        StackTable(StackTable&&) = delete;
+        StackTable& operator=(const StackTable&) = delete;
+        StackTable& operator=(StackTable&&) = delete;
+
+        // get the scope id of a stack of return addresses, innermost first
+        uint32_t intern(void* const*, int);
+
+        // held across fork, so that the child gets a consistent copy
+        inline void lock() { guard_.lock(); }
+        inline void unlock() { guard_.unlock(); }
+
+    private:
+        struct Key
+        {
+            std::array<void*, MAX_DEPTH> frames;
+            int depth;
+
+            bool operator==(const Key& other) const
+            {
+                return depth == other.depth
+                       && std::equal(frames.begin(), frames.begin()+depth, other.frames.begin());
+            }
+        };
+
+        struct KeyHash
+        {
+            size_t operator()(const Key& k) const
+            {
+                uint64_t h = k.depth;
+                for(int i=0;i<k.depth;i++) {
+                    h = (h ^ reinterpret_cast<uintptr_t>(k.frames[i])) * 0x9E3779B97F4A7C15ull;
+                }
+                return static_cast<size_t>(h ^ (h >> 32));
+            }
+        };
+
+        // name one frame after its function, or its object file and offset
+        static std::string frame_name(void*);
+
+        ScopeRegistry& scopes_;
+        std::unordered_map<Key, uint32_t, KeyHash> ids_;
+        std::mutex guard_;
+    };
+
+
+    // Address ranges mapped with mmap, with the scope that mapped them.
+    // Mappings are rare and large compared to heap blocks, so one lock is
+    // enough. Partial unmaps and remaps split or move the ranges.
+    class MappingTable
+    {
+    public:
+        MappingTable() = default;
+        ~MappingTable() = default;
+
+        // non-copyable, non-movable
+        MappingTable(const MappingTable&) = delete;
+        MappingTable(MappingTable&&) = delete;
+        MappingTable& operator=(const MappingTable&) = delete;
+        MappingTable& operator=(MappingTable&&) = delete;
+
+        // add a range, replacing any ranges it overlaps
+        void add(uintptr_t, size_t, uint32_t);
+
+        // remove a range, or the parts of ranges it overlaps
+        void remove(uintptr_t, size_t);
+
+        // move a range to a new address and size, keeping its scope, and
+        // optionally keeping the old range too
+        void remap(uintptr_t, size_t, uintptr_t, size_t, bool);
+
+        // get current mapped bytes per scope, indexed by scope id
+        std::vector<size_t> get_extents() const;
+
+        // held across fork, so that the child gets a consistent copy
+        inline void lock() { guard_.lock(); }
+        inline void unlock() { guard_.unlock(); }
+
+    private:
+        struct Range
+        {
+            uintptr_t end;
+            uint32_t scope;
+        };
+
+        void add_locked(uintptr_t, size_t, uint32_t);
+        void remove_locked(uintptr_t, size_t);
+
+        std::map<uintptr_t, Range> ranges_;
+        std::vector<size_t> bytes_;
+        mutable std::mutex guard_;
+    };
+
+
+    class Tracking;
+
+    class TrackingThread
+    {
+    public:
+        TrackingThread() = delete;
+        TrackingThread(Tracking&);
+        ~TrackingThread();
+
+        // non-copyable, non-movable
+        TrackingThread(const TrackingThread&) = delete;
+        TrackingThread(TrackingThread&&) = delete;
+        TrackingThread& operator=(const TrackingThread&) = delete;
+        TrackingThread& operator=(TrackingThread&&) = delete;
+    private:
+        void run();
+
+        // next interval after a snapshot that changed the heap total by
+        // the given fraction
+        std::chrono::milliseconds next_interval(std::chrono::milliseconds, double) const;
+
+        std::atomic<bool> running_;
+        Tracking& tracking_;
+        // snapshot interval, adapted between the two when they differ
+        std::chrono::milliseconds min_interval_;
+        std::chrono::milliseconds max_interval_;
+        std::unique_ptr<std::thread> tracking_thread_;
+        std::condition_variable tracking_thread_cv_;
+        std::mutex tracking_thread_cv_mutex_;
+    };
+
+
+    // Answers live queries on a Unix socket, set with MEMSCOPETRACK_SOCKET.
+    // Each connection gets the current snapshot in the text format, and
+    // is then closed, so e.g. "socat - UNIX-CONNECT:<path>" prints it.
+    class QueryServer
+    {
+    public:
+        QueryServer() = delete;
+        QueryServer(std::string, Tracking&, Log&);
+        ~QueryServer();
+
+        // non-copyable, non-movable
+        QueryServer(const QueryServer&) = delete;
+        QueryServer(QueryServer&&) = delete;
+        QueryServer& operator=(const QueryServer&) = delete;
+        QueryServer& operator=(QueryServer&&) = delete;
+
+    private:
+        void run();
+        void answer(int);
+
+        std::string path_;
+        Tracking& tracking_;
+        int fd_;
+        std::vector<std::string> names_;
+        std::chrono::steady_clock::time_point start_;
+
+        std::atomic<bool> running_;
+        std::unique_ptr<std::thread> thread_;
+    };
+
+
+    // Publishes every snapshot to a fixed-layout shared memory segment
+    // (see format.h), which monitoring tools can map and read at any time.
+    class SharedSegment
+    {
+    public:
+        SharedSegment() = delete;
+        SharedSegment(std::string, Log&);
+        ~SharedSegment();
+
+        // non-copyable, non-movable
+        SharedSegment(const SharedSegment&) = delete;
+        SharedSegment(SharedSegment&&) = delete;
+        SharedSegment& operator=(const SharedSegment&) = delete;
+        SharedSegment& operator=(SharedSegment&&) = delete;
+
+        // write a snapshot; names must cover every id in it
+        void publish(const Snapshot&, const std::vector<std::string>&);
+
+    private:
+        template<typename T>
+        static inline void store(T& field, T value)
+        {
+            __atomic_store_n(&field, value, __ATOMIC_RELAXED);
+        }
+
+        std::string path_;
+        char* base_;
+        size_t size_;
+        format::ShmHeader* header_;
+        uint32_t defined_ = 1; // scope 0 is never written
+    };
+
+
+    // Soft limit on the live heap bytes of a scope. Threads add their
+    // share of bytes in steps of at most 64KB, so the count lags the
+    // real one by less than a step per thread.
+    struct Budget
+    {
+        static constexpr int64_t MAX_STEP = 64*1024;
+
+        uint32_t scope = 0;
+        std::atomic<int64_t> limit{0};      // 0 for no limit
+        std::atomic<int64_t> bytes{0};
+        std::atomic<bool> over{false};      // until back under the limit
+        std::atomic<uint64_t> crossings{0};
+        // set with Tracking::budgets_guard_ held
+        memory::BudgetCallback callback = nullptr;
+        void* arg = nullptr;
+
+        inline int64_t step(int64_t limit) const
+        { return std::max<int64_t>(1, std::min(MAX_STEP, limit/16)); }
+    };
+
+
+    class Tracking
+    {
+    public:
+        Tracking() = delete;
+        Tracking(std::shared_ptr<Log>);
+        ~Tracking();
+
+        // non-copyable, non-movable
+        Tracking(const Tracking&) = delete;
+        Tracking(Tracking&&) = delete;
+        Tracking& operator=(const Tracking&) = delete;
+        Tracking& operator=(Tracking&&) = delete;
+
+        // start tracking to file
+        void start();
+
+        // stop tracking to file
+        void stop();
+
+        // Around fork: every lock is taken before it, so the child gets
+        // a consistent copy of the tables, and released after it. The
+        // child keeps the live blocks it inherited, and on restart lets
+        // go of the parent's threads and files and starts its own.
+        void prepare_fork();
+        void parent_after_fork();
+        void child_after_fork();
+        void restart();
+
+        // add memory at address with scope and size, returning the
+        // budget this took over its limit, if any
+        Budget* add(void*, uint32_t, size_t);
+
+        // remove memory at address
+        void remove(void*);
+
+        // add memory at address to a scope without recording the
+        // address, returning the budget this took over its limit, if any
+        Budget* add_tagged(void*, uint32_t, size_t);
+
+        // remove memory at address from a scope without an address lookup
+        void remove_tagged(void*, uint32_t, size_t);
+
+        // get current bytes per scope, indexed by scope id
+        std::vector<size_t> get_extents() const;
+
+        // get all current per-scope series, without the time, and
+        // optionally start a new peak interval
+        Snapshot get_snapshot(bool reset_peaks = true);
+
+        // add an mmap'd range to a scope
+        inline void add_mapping(void* addr, size_t length, uint32_t scope)
+        { mappings_.add(reinterpret_cast<uintptr_t>(addr), length, scope); }
+
+        // remove an munmap'd range
+        inline void remove_mapping(void* addr, size_t length)
+        { mappings_.remove(reinterpret_cast<uintptr_t>(addr), length); }
+
+        // move an mremap'd range
+        inline void remap(void* old_addr, size_t old_length, void* addr, size_t length, bool keep_old)
+        {
+            mappings_.remap(reinterpret_cast<uintptr_t>(old_addr), old_length,
+                            reinterpret_cast<uintptr_t>(addr), length, keep_old);
+        }
+
+        // publish a snapshot to the shared memory segment, if there is one
+        inline void publish(const Snapshot& snapshot, const std::vector<std::string>& names)
+        {
+            if (shm_) {
+                shm_->publish(snapshot, names);
+            }
+        }
+
+        // get current heap bytes summed over all scopes
+        inline size_t get_total() const
+        { return scope_map_.total(); }
+
+        // number of registered scopes, including the empty scope
+        inline size_t get_scope_count() const
+        { return scopes_.size(); }
+
+        // advance the clock that new blocks are stamped with, every
+        // time the snapshot thread wakes up
+        inline void tick()
+        { now_.store(ticks(), std::memory_order_relaxed); }
+
+        // set the budget of a scope, 0 to remove it
+        void set_budget(uint32_t, size_t, memory::BudgetCallback, void*);
+
+        // tell the user a budget went over its limit; runs the callback,
+        // so call it outside any RecursionGuard
+        void notify(Budget&);
+
+        // get the id of a scope name
+        inline uint32_t get_scope_id(const std::string& name)
+        { return scopes_.intern(name); }
+
+        // get the name of a scope id, valid for the lifetime of Tracking
+        inline const char* get_scope_name(uint32_t id) const
+        { return scopes_.c_str(id); }
+
+        // get the id of a child scope
+        inline uint32_t get_child_scope_id(uint32_t parent, const std::string& name)
+        { return scopes_.child(parent, name); }
+
+        // get the parent of a scope id
+        inline uint32_t get_parent_scope_id(uint32_t id) const
+        { return scopes_.parent(id); }
+
+        // get the scope id of a call stack, innermost frame first
+        inline uint32_t get_stack_id(void* const* frames, int depth)
+        { return stacks_.intern(frames, depth); }
+
+        // get the names of scope ids, starting at the given id
+        inline std::vector<std::string> get_scope_names(uint32_t first) const
+        { return scopes_.names(first); }
+
+        // get library path
+        inline std::string get_library_path() const
+        { return library_path_; }
+
+    private:
+        // sum the values of scopes deeper than depth_ into their ancestors
+        void roll_up(Snapshot&);
+
+        // Breakdown key of the calling thread
+        uint16_t thread_key(ThreadState&);
+
+        // budget of a scope, if it ever had one
+        inline Budget* budget(uint32_t scope) const
+        {
+            size_t index = scope >> ThreadState::CHUNK_BITS;
+            if (index >= ThreadState::MAX_CHUNKS) {
+                return nullptr;
+            }
+            BudgetChunk* chunk = budgets_[index].load(std::memory_order_acquire);
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+            return (*chunk)[scope & (ThreadState::CHUNK_SIZE-1)].load(std::memory_order_acquire);
+        }
+
+        // count bytes against the budget of a scope, returning it if
+        // this took it over the limit
+        Budget* charge(ThreadState&, uint32_t, int64_t);
+
+        // parse "scope=bytes" budgets, one per separated item
+        void read_budgets(const std::string&, char, const char*);
+
+        // AddressTable ticks since the start of tracking
+        uint32_t ticks() const;
+
+        // log the unfreed blocks in the address table, by scope, size
+        // class and age
+        void report_leaks();
+
+        // NUMA node of the calling thread's CPU
+        inline uint16_t current_node() const
+        {
+            int cpu = sched_getcpu();
+            return cpu >= 0 && static_cast<size_t>(cpu) < cpu_nodes_.size() ? cpu_nodes_[cpu] : 0;
+        }
+
+        std::shared_ptr<Log> log_;
+        std::string library_path_;
+        ScopeRegistry scopes_;
+        StackTable stacks_;
+        ThreadStateList scope_map_;
+        AddressTable ptr_map_;
+        MappingTable mappings_;
+        std::unique_ptr<TrackingThread> tracking_thread_;
+        std::unique_ptr<EventRecorder> events_;
+        std::unique_ptr<QueryServer> query_;
+        std::unique_ptr<SharedSegment> shm_;
+        bool stats_;
+
+        // with MEMSCOPETRACK_BREAKDOWN, heap bytes by allocating thread
+        // and by NUMA node, for blocks in the address table
+        std::unique_ptr<Breakdown> threads_;
+        std::unique_ptr<Breakdown> nodes_;
+        std::array<std::atomic<uint32_t>, Breakdown::MAX_KEYS> thread_ids_{};
+        std::atomic<uint32_t> next_thread_key_{1};
+        std::vector<uint16_t> cpu_nodes_;
+
+        // budgets by scope id, never deleted before Tracking is; chunks
+        // and budgets are only created with budgets_guard_ held
+        using BudgetChunk = std::array<std::atomic<Budget*>, ThreadState::CHUNK_SIZE>;
+        std::array<std::atomic<BudgetChunk*>, ThreadState::MAX_CHUNKS> budgets_{};
+        std::atomic<bool> any_budget_{false};
+        std::mutex budgets_guard_;
+
+        // with MEMSCOPETRACK_DEPTH, snapshots sum each scope into its
+        // ancestor at that depth, looked up in rollup_ (by scope id)
+        unsigned depth_;
+        std::vector<uint32_t> rollup_;
+        std::vector<unsigned> depths_;
+        std::mutex rollup_guard_;
+
+        // with MEMSCOPETRACK_LEAKS, how many of the largest groups of
+        // unfreed blocks to list at exit
+        unsigned leaks_;
+        std::chrono::steady_clock::time_point start_;
+        std::atomic<uint32_t> now_{0};
+
+        // highest peak of each scope, and of the sum of scope peaks,
+        // over all snapshots
+        std::vector<size_t> peaks_;
+        size_t total_peak_;
+        std::mutex peaks_guard_;
+    };
+
+
+    /** Implementation **/
+
+    Outfile::Outfile(std::string path)
+        : filename_(path), fd_(-1), member_open_(false), any_member_(false),
+          flush_interval_(10000), closing_(false)
+    {
+        auto has_suffix = [&](const std::string &suffix)
+        {
+            return filename_.size() >= suffix.size() &&
+                   filename_.compare(filename_.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        // This runs inside the first malloc, or in a forked child, so
+        // failing must not take the application down with it.
+        fd_ = open(filename_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd_ < 0) {
+            fprintf(stderr, "mem-scope-track: cannot open %s: %s\n", filename_.c_str(), strerror(errno));
+            return;
+        }
+        char* flush = std::getenv("MEMSCOPETRACK_FLUSH");
+        if (flush != nullptr) {
+            flush_interval_ = std::chrono::milliseconds(static_cast<long long>(atof(flush)*1000));
+        }
+        if (has_suffix(".gz")) {
+            // gzip the file, at level 0 (stored) to 9 (smallest)
+            int level = Z_DEFAULT_COMPRESSION;
+            char* compression = std::getenv("MEMSCOPETRACK_COMPRESSION");
+            if (compression != nullptr && *compression >= '0' && *compression <= '9') {
+                level = atoi(compression);
+            }
+            zstream_ = std::make_unique<z_stream>();
+            // window bits 15+16 for a gzip header and trailer
+            if (deflateInit2(zstream_.get(), level, Z_DEFLATED, 15+16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) {
+                fprintf(stderr, "mem-scope-track: cannot compress %s\n", filename_.c_str());
+                zstream_.reset();
+                close(fd_);
+                fd_ = -1;
+                return;
+            }
+        }
+        thread_ = std::make_unique<std::thread>(&Outfile::run, this);
+    }
+
+    Outfile::~Outfile()
+    {
+        if (!is_open()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        cv_.notify_all();
+        thread_->join();
+        if (zstream_) {
+            deflateEnd(zstream_.get());
+        }
+        close(fd_);
+    }
+
+    void
+    Outfile::write(const char* data, size_t size)
+    {
+        if (!is_open()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        room_cv_.wait(lock, [&](){return front_.size() < MAX_BUFFERED;});
+        front_.append(data, size);
+        if (front_.size() >= BLOCK) {
+            cv_.notify_all();
+        }
+    }
+
+    void
+    Outfile::run()
+    {
+        RecursionGuard r;
+        auto last_flush = std::chrono::steady_clock::now();
+        auto ready = [&](){return closing_ || front_.size() >= BLOCK;};
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            if (flush_interval_.count() > 0) {
+                cv_.wait_until(lock, last_flush + flush_interval_, ready);
+            } else {
+                cv_.wait(lock, ready);
+            }
+            auto now = std::chrono::steady_clock::now();
+            // closing_ is only set once nothing else writes
+            bool last = closing_;
+            bool flush = last || (flush_interval_.count() > 0 && now >= last_flush + flush_interval_);
+            std::swap(front_, back_);
+            lock.unlock();
+            room_cv_.notify_all();
+
+            deliver(back_, flush, last);
+            back_.clear();
+            if (flush) {
+                last_flush = now;
+            }
+            if (last) {
+                break;
+            }
+            lock.lock();
+        }
+    }
+
+    void
+    Outfile::deliver(const std::string& data, bool flush, bool last)
+    {
+        if (!zstream_) {
+            // plain files are written through, which is as good as a flush
+            write_fd(data.data(), data.size());
+            return;
+        }
+        z_stream& z = *zstream_;
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        z.avail_in = data.size();
+        member_open_ |= !data.empty();
+        // an empty file still gets one (empty) member, to be valid gzip
+        bool finish = flush && (member_open_ || (last && !any_member_));
+        int mode = finish ? Z_FINISH : Z_NO_FLUSH;
+        compressed_.resize(BLOCK);
+        while (true) {
+            z.next_out = reinterpret_cast<Bytef*>(&compressed_[0]);
+            z.avail_out = compressed_.size();
+            int ret = deflate(&z, mode);
+            write_fd(compressed_.data(), compressed_.size() - z.avail_out);
+            if (ret == Z_STREAM_ERROR || (finish ? ret == Z_STREAM_END : z.avail_out != 0)) {
+                break;
+            }
+        }
+        if (finish) {
+            // readers take concatenated members as one stream
+            deflateReset(&z);
+            member_open_ = false;
+            any_member_ = true;
+        }
+    }
+
+    void
+    Outfile::write_fd(const char* data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = ::write(fd_, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return; // nowhere to report it, and retrying will not help
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    std::string randstr(unsigned length)
+    {
+        auto randchar = []() -> char
+        {
+            const char charset[] =
+            "0123456789"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz";
+            const size_t max_index = (sizeof(charset) - 2);
+            std::mt19937 rng (std::random_device{}());
+            std::uniform_int_distribution<> dist (0, max_index);
+            return charset[ dist(rng) ];
+        };
+
+        std::string ret;
+        for(unsigned i=0;i<length;i++) {
+            ret.push_back(randchar());
+        }
+        return ret;
+    }
+
+    RandomOutfile::RandomOutfile()
+        : Outfile("mem-scope-track."+randstr(10)+".gz")
+    { }
+
+
+    ScopeRegistry::ScopeRegistry()
+    {
+        names_.emplace_back();
+        parents_.push_back(0);
+        ids_.emplace(names_.back(), 0);
+    }
+
+    uint32_t
+    ScopeRegistry::intern(const std::string& name, bool path)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        return intern_locked(name, path);
+    }
+
+    uint32_t
+    ScopeRegistry::intern_locked(const std::string& name, bool path)
+    {
+        auto iter = ids_.find(name);
+        if (iter != ids_.end()) {
+            return iter->second;
+        }
+        uint32_t parent = 0;
+        size_t slash = path ? name.rfind('/') : std::string::npos;
+        if (slash != std::string::npos && slash > 0) {
+            parent = intern_locked(name.substr(0, slash), true);
+        }
+        uint32_t id = static_cast<uint32_t>(names_.size());
+        names_.emplace_back(name);
+        parents_.push_back(parent);
+        ids_.emplace(name, id);
+        return id;
+    }
+
+    uint32_t
+    ScopeRegistry::child(uint32_t parent, const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if (parent == 0 || parent >= names_.size()) {
+            return intern_locked(name, true);
+        }
+        return intern_locked(names_[parent] + "/" + name, true);
+    }
+
+    uint32_t
+    ScopeRegistry::parent(uint32_t id) const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        return id < parents_.size() ? parents_[id] : 0;
+    }
+
+    std::vector<uint32_t>
+    ScopeRegistry::parents(uint32_t first) const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        std::vector<uint32_t> ret;
+        if (first < parents_.size()) {
+            ret.assign(parents_.begin()+first, parents_.end());
+        }
+        return ret;
+    }
+
+    std::string
+    ScopeRegistry::name(uint32_t id) const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        if (id >= names_.size()) {
+            return std::string();
+        }
+        return names_[id];
+    }
+
+    const char*
+    ScopeRegistry::c_str(uint32_t id) const
+    {
+        // deque elements never move, so the pointer stays valid
+        std::lock_guard<std::mutex> lock(guard_);
+        if (id >= names_.size()) {
+            return "";
+        }
+        return names_[id].c_str();
+    }
+
+    std::vector<std::string>
+    ScopeRegistry::names(uint32_t first) const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        std::vector<std::string> ret;
+        if (first < names_.size()) {
+            ret.assign(names_.begin()+first, names_.end());
+        }
+        return ret;
+    }
+
+    size_t
+    ScopeRegistry::size() const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        return names_.size();
+    }
+
+
+    bool
+    AddressTable::insert(void* addr, const Entry& entry, Entry& prev)
+    {
+        Shard& shard = shards_[shard_index(addr)];
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto ret = shard.map.emplace(addr, entry);
+        if (!ret.second) {
+            prev = ret.first->second;
+        }
+        shard.size.store(shard.map.size(), std::memory_order_relaxed);
+        return ret.second;
+    }
+
+    bool
+    AddressTable::erase(void* addr, Entry& out)
+    {
+        Shard& shard = shards_[shard_index(addr)];
+        if (shard.size.load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto iter = shard.map.find(addr);
+        if (iter == shard.map.end()) {
+            return false;
+        }
+        out = std::move(iter->second);
+        shard.map.erase(iter);
+        shard.size.store(shard.map.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+
+    void
+    AddressTable::lock()
+    {
+        for(auto& shard : shards_) {
+            shard.lock.lock();
+        }
+    }
+
+    void
+    AddressTable::unlock()
+    {
+        for(auto& shard : shards_) {
+            shard.lock.unlock();
+        }
+    }
+
+
+    ThreadState::~ThreadState()
+    {
+        delete events.load();
+        for(auto& chunk : chunks) {
+            delete chunk.load();
+        }
+    }
+
+    void
+    ThreadState::read(const Counters& c, ScopeStats& out, uint32_t interval) const
+    {
+        int64_t bytes, high, last_high;
+        uint32_t e;
+        for(;;) {
+            uint32_t seq = c.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield(); // owner is mid-update
+                continue;
+            }
+            bytes = c.bytes.load(std::memory_order_relaxed);
+            high = c.high.load(std::memory_order_relaxed);
+            last_high = c.last_high.load(std::memory_order_relaxed);
+            e = c.epoch.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (c.seq.load(std::memory_order_relaxed) == seq) {
+                break;
+            }
+        }
+        out.bytes += bytes;
+        // An owner that already moved on to the next interval saved the
+        // high of this one, and no update during the interval means bytes
+        // stayed the same.
+        if (e == interval) {
+            out.high += high;
+        } else if (e == interval+1) {
+            out.high += last_high;
+        } else {
+            out.high += bytes;
+        }
+        out.allocs += c.allocs.load(std::memory_order_relaxed);
+        out.frees += c.frees.load(std::memory_order_relaxed);
+        out.allocated += c.allocated.load(std::memory_order_relaxed);
+        for(unsigned i=0;i<format::SIZE_CLASSES;i++) {
+            out.sizes[i] += c.sizes[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    ThreadStateList::ThreadStateList()
+    {
+        tables_.emplace_back(std::make_unique<ThreadState>());
+        orphan_ = tables_.back().get();
+        orphan_->epoch = &epoch_;
+        orphan_->in_use = true;
+        orphan_->shared = true;
+    }
+
+    ThreadState&
+    ThreadStateList::local()
+    {
+        if (local_ == nullptr) {
+            if (exited_) {
+                return *orphan_;
+            }
+            local_ = &acquire();
+            local_->thread = static_cast<uint32_t>(syscall(SYS_gettid));
+            local_->origin = 0;
+        }
+        return *local_;
+    }
+
+    ThreadState&
+    ThreadStateList::acquire()
+    {
+        // hand the table back when the thread exits
+        struct ExitHook
+        {
+            ThreadStateList* list;
+            ~ExitHook()
+            {
+                exited_ = true;
+                if (local_ != nullptr) {
+                    list->release(*local_);
+                    local_ = nullptr;
+                }
+            }
+        };
+        static thread_local ExitHook hook{this};
+
+        std::lock_guard<std::mutex> lock(tables_guard_);
+        for(auto& t : tables_) {
+            if (!t->in_use) {
+                t->in_use = true;
+                return *t;
+            }
+        }
+        tables_.emplace_back(std::make_unique<ThreadState>());
+        tables_.back()->epoch = &epoch_;
+        tables_.back()->in_use = true;
+        return *tables_.back();
+    }
+
+    void
+    ThreadStateList::release(ThreadState& t)
+    {
+        std::lock_guard<std::mutex> lock(tables_guard_);
+        t.in_use = false;
+    }
+
+    void
+    ThreadStateList::lock()
+    {
+        tables_guard_.lock();
+        orphan_->lock.lock();
+    }
+
+    void
+    ThreadStateList::unlock()
+    {
+        orphan_->lock.unlock();
+        tables_guard_.unlock();
+    }
+
+    void
+    ThreadStateList::after_fork()
+    {
+        for(auto& t : tables_) {
+            if (t.get() != local_ && t.get() != orphan_) {
+                t->in_use = false;
+            }
+            // a thread may have died halfway through an update
+            for(auto& c : t->chunks) {
+                ThreadState::Chunk* chunk = c.load(std::memory_order_relaxed);
+                if (chunk == nullptr) {
+                    continue;
+                }
+                for(auto& counters : chunk->scopes) {
+                    uint32_t seq = counters.seq.load(std::memory_order_relaxed);
+                    if (seq & 1) {
+                        counters.seq.store(seq+1, std::memory_order_relaxed);
+                    }
+                }
+            }
+            // the parent writes out its own events
+            EventRing* ring = t->events.load(std::memory_order_relaxed);
+            if (ring != nullptr) {
+                ring->clear();
+            }
+        }
+    }
+
+    std::vector<ScopeStats>
+    ThreadStateList::merge(bool reset_high) const
+    {
+        // updates from here on belong to the next peak interval
+        uint32_t interval = reset_high ? epoch_.fetch_add(1) : epoch_.load();
+        std::vector<ScopeStats> sum;
+        std::lock_guard<std::mutex> lock(tables_guard_);
+        for(auto& t : tables_) {
+            for(size_t index=0;index<ThreadState::MAX_CHUNKS;index++) {
+                ThreadState::Chunk* chunk = t->chunks[index].load(std::memory_order_acquire);
+                if (chunk == nullptr) {
+                    continue;
+                }
+                size_t first = index << ThreadState::CHUNK_BITS;
+                if (sum.size() < first + ThreadState::CHUNK_SIZE) {
+                    sum.resize(first + ThreadState::CHUNK_SIZE);
+                }
+                for(size_t i=0;i<ThreadState::CHUNK_SIZE;i++) {
+                    t->read(chunk->scopes[i], sum[first+i], interval);
+                }
+            }
+        }
+        return sum;
+    }
+
+    size_t
+    ThreadStateList::total() const
+    {
+        int64_t sum = 0;
+        for_each([&](const ThreadState& t){
+            sum += t.total.load(std::memory_order_relaxed);
+        });
+        return sum < 0 ? 0 : static_cast<size_t>(sum);
+    }
+
+
+    size_t
+    Sampler::sample_slow(size_t size, size_t mean)
+    {
+        if (state_ == 0) {
+            // first use on this thread
+            state_ = reinterpret_cast<uintptr_t>(this)
+                     ^ std::chrono::steady_clock::now().time_since_epoch().count();
+            state_ |= 1;
+            left_ = next_interval(mean);
+            if (left_ > size) {
+                left_ -= size;
+                return 0;
+            }
+        }
+        left_ = next_interval(mean);
+        double p = -std::expm1(-static_cast<double>(size) / mean);
+        return std::max(size, static_cast<size_t>(size / p + 0.5));
+    }
+
+    size_t
+    Sampler::next_interval(size_t mean)
+    {
+        // xorshift64*, then an exponential draw from the top 53 bits
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        uint64_t r = state_ * 0x2545F4914F6CDD1Dull;
+        double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+        return static_cast<size_t>(-std::log(u) * mean) + 1;
+    }
+
+
+
+    void
+    format_text(const Snapshot& snapshot, const std::vector<std::string>& names, std::string& out,
+                std::map<uint64_t, std::vector<size_t>>* previous)
+    {
+        out += "---" + std::to_string(snapshot.usec) + "\n";
+        for(size_t id=1;id<snapshot.heap.size();id++) {
+            out += names[id] + "|" + std::to_string(snapshot.heap[id]) + "\n";
+        }
+        for(auto& series : snapshot.series) {
+            std::string name = format::series_name(series.kind);
+            std::vector<size_t>* last = nullptr;
+            if (previous) {
+                last = &(*previous)[series.kind];
+                if (last->size() < series.values.size()) {
+                    last->resize(series.values.size(), 0);
+                }
+            }
+            for(size_t id=1;id<series.values.size();id++) {
+                size_t value = series.values[id];
+                if (last ? value != (*last)[id] : value != 0) {
+                    out += "+" + name + " " + names[id] + "|" + std::to_string(value) + "\n";
+                    if (last) {
+                        (*last)[id] = value;
+                    }
+                }
+            }
+        }
+    }
+
+    void
+    TextWriter::write(const Snapshot& snapshot, const std::vector<std::string>& names)
+    {
+        buf_.clear();
+        format_text(snapshot, names, buf_, &previous_series_);
+        out_.write(buf_.data(), buf_.size());
+    }
+
+    BinaryWriter::BinaryWriter(Outfile& out)
+        : out_(out)
+    {
+        buf_.append(format::MAGIC, sizeof(format::MAGIC));
+        buf_.push_back(static_cast<char>(format::VERSION));
+        out_.write(buf_.data(), buf_.size());
+    }
+
+    void
+    BinaryWriter::put_changes(const std::vector<size_t>& values, std::vector<size_t>& previous)
+    {
+        if (previous.size() < values.size()) {
+            previous.resize(values.size(), 0);
+        }
+        size_t count = 0;
+        for(size_t id=1;id<values.size();id++) {
+            if (values[id] != previous[id]) {
+                count++;
+            }
+        }
+        format::put_varint(buf_, count);
+        size_t previous_id = 0;
+        for(size_t id=1;id<values.size();id++) {
+            if (values[id] != previous[id]) {
+                int64_t delta = static_cast<int64_t>(values[id] - previous[id]);
+                format::put_varint(buf_, id - previous_id);
+                format::put_varint(buf_, format::zigzag(delta));
+                previous[id] = values[id];
+                previous_id = id;
+            }
+        }
+    }
+
+    void
+    BinaryWriter::write(const Snapshot& snapshot, const std::vector<std::string>& names)
+    {
+        buf_.clear();
+        size_t scopes = snapshot.heap.size();
+        for(auto& series : snapshot.series) {
+            scopes = std::max(scopes, series.values.size());
+        }
+        for(; defined_ < scopes; defined_++) {
+            buf_.push_back(format::SCOPE);
+            format::put_varint(buf_, defined_);
+            format::put_varint(buf_, names[defined_].size());
+            buf_.append(names[defined_]);
+        }
+
+        buf_.push_back(format::TICK);
+        format::put_varint(buf_, snapshot.usec - previous_usec_);
+        put_changes(snapshot.heap, previous_);
+        for(auto& series : snapshot.series) {
+            buf_.push_back(format::SERIES);
+            format::put_varint(buf_, series.kind);
+            put_changes(series.values, previous_series_[series.kind]);
+        }
+        previous_usec_ = snapshot.usec;
+        out_.write(buf_.data(), buf_.size());
+    }
+
+    std::unique_ptr<SnapshotWriter>
+    make_writer(Outfile& out)
+    {
+        char* format = std::getenv("MEMSCOPETRACK_FORMAT");
+        if (format != nullptr && strcmp(format, "binary") == 0) {
+            return std::make_unique<BinaryWriter>(out);
+        }
+        return std::make_unique<TextWriter>(out);
+    }
+
+
+    Breakdown::~Breakdown()
+    {
+        for(auto& c : columns_) {
+            Column* column = c.load();
+            if (column != nullptr) {
+                for(auto& chunk : column->chunks) {
+                    delete chunk.load();
+                }
+                delete column;
+            }
+        }
+    }
+
+    std::atomic<int64_t>&
+    Breakdown::cell(uint32_t key, uint32_t scope)
+    {
+        size_t index = scope >> ThreadState::CHUNK_BITS;
+        if (key >= MAX_KEYS || index >= ThreadState::MAX_CHUNKS) {
+            return overflow_;
+        }
+        // any thread may create a column or chunk, the first one wins
+        Column* column = columns_[key].load(std::memory_order_acquire);
+        if (column == nullptr) {
+            Column* created = new Column;
+            if (columns_[key].compare_exchange_strong(column, created, std::memory_order_acq_rel)) {
+                column = created;
+            } else {
+                delete created;
+            }
+        }
+        Chunk* chunk = column->chunks[index].load(std::memory_order_acquire);
+        if (chunk == nullptr) {
+            Chunk* created = new Chunk{};
+            if (column->chunks[index].compare_exchange_strong(chunk, created, std::memory_order_acq_rel)) {
+                chunk = created;
+            } else {
+                delete created;
+            }
+        }
+        return (*chunk)[scope & (ThreadState::CHUNK_SIZE-1)];
+    }
+
+    std::vector<std::pair<uint32_t, std::vector<size_t>>>
+    Breakdown::collect(size_t scopes, bool advance)
+    {
+        std::lock_guard<std::mutex> lock(collect_guard_);
+        std::vector<std::pair<uint32_t, std::vector<size_t>>> ret;
+        for(uint32_t key=0;key<MAX_KEYS;key++) {
+            Column* column = columns_[key].load(std::memory_order_acquire);
+            if (column == nullptr) {
+                continue;
+            }
+            std::vector<size_t> values(scopes, 0);
+            bool any = false;
+            for(size_t index=0;index<ThreadState::MAX_CHUNKS;index++) {
+                size_t first = index << ThreadState::CHUNK_BITS;
+                if (first >= scopes) {
+                    break;
+                }
+                Chunk* chunk = column->chunks[index].load(std::memory_order_acquire);
+                if (chunk == nullptr) {
+                    continue;
+                }
+                for(size_t i=0;i<ThreadState::CHUNK_SIZE && first+i<scopes;i++) {
+                    int64_t bytes = (*chunk)[i].load(std::memory_order_relaxed);
+                    if (bytes > 0) {
+                        values[first+i] = bytes;
+                        any = true;
+                    }
+                }
+            }
+            if (any || column->reported) {
+                ret.emplace_back(key, std::move(values));
+            }
+            if (advance) {
+                column->reported = any;
+            }
+        }
+        return ret;
+    }
+
+
+    EventRing::EventRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        buf_.reset(new format::Event[size]);
+        mask_ = size - 1;
+    }
+
+    void
+    EventRing::pop(std::vector<format::Event>& out)
+    {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        for(; tail != head; tail++) {
+            out.push_back(buf_[tail & mask_]);
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+
+    EventRecorder::EventRecorder(std::string filename, const ThreadStateList& threads,
+                                 const ScopeRegistry& scopes)
+        : threads_(threads), scopes_(scopes), capacity_(65536), block_(false),
+          start_(std::chrono::steady_clock::now()), running_(true)
+    {
+        char* capacity = std::getenv("MEMSCOPETRACK_EVENTS_BUFFER");
+        if (capacity != nullptr && strtoull(capacity, nullptr, 10) > 0) {
+            capacity_ = strtoull(capacity, nullptr, 10);
+        }
+        char* policy = std::getenv("MEMSCOPETRACK_EVENTS_POLICY");
+        block_ = policy != nullptr && strcmp(policy, "block") == 0;
+
+        outfile_ = std::make_unique<Outfile>(filename);
+        outfile_->write(format::EVENT_MAGIC, sizeof(format::EVENT_MAGIC));
+        char version = static_cast<char>(format::VERSION);
+        outfile_->write(&version, 1);
+
+        thread_ = std::make_unique<std::thread>(&EventRecorder::run, this);
+    }
+
+    EventRecorder::~EventRecorder()
+    {
+        running_ = false;
+        cv_.notify_all();
+        thread_->join();
+    }
+
+    void
+    EventRecorder::record(ThreadState& local, uint8_t type, void* addr,
+                          uint32_t scope, size_t size)
+    {
+        if (local.shared) {
+            return; // rings have a single producer
+        }
+        EventRing* ring = local.events.load(std::memory_order_relaxed);
+        if (ring == nullptr) {
+            ring = new EventRing(capacity_);
+            local.events.store(ring, std::memory_order_release);
+        }
+        format::Event e{};
+        e.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - start_).count();
+        e.addr = reinterpret_cast<uintptr_t>(addr);
+        e.size = size;
+        e.scope = scope;
+        e.thread = local.thread;
+        e.type = type;
+        while (!ring->push(e)) {
+            if (!block_ || !running_) {
+                ring->dropped.store(ring->dropped.load(std::memory_order_relaxed)+1,
+                                    std::memory_order_relaxed);
+                return;
+            }
+            // wait for the writer to make room
+            std::this_thread::yield();
+        }
+    }
+
+    void
+    EventRecorder::drain(std::vector<format::Event>& batch)
+    {
+        batch.clear();
+        threads_.for_each([&](const ThreadState& t){
+            EventRing* ring = t.events.load(std::memory_order_acquire);
+            if (ring != nullptr) {
+                ring->pop(batch);
+            }
+        });
+        if (batch.empty()) {
+            return;
+        }
+
+        // define scopes first, so every event refers to a known name
+        std::string buf;
+        auto names = scopes_.names(defined_);
+        for(auto& name : names) {
+            buf.push_back(format::SCOPE);
+            format::put_varint(buf, defined_++);
+            format::put_varint(buf, name.size());
+            buf.append(name);
+        }
+        buf.push_back(format::EVENTS);
+        format::put_varint(buf, batch.size());
+        outfile_->write(buf.data(), buf.size());
+        outfile_->write(reinterpret_cast<const char*>(batch.data()),
+                        batch.size()*sizeof(format::Event));
+    }
+
+    void
+    EventRecorder::run()
+    {
+        RecursionGuard r;
+        using namespace std::chrono_literals;
+        std::vector<format::Event> batch;
+        std::unique_lock<std::mutex> lock(cv_mutex_);
+        while (running_) {
+            cv_.wait_for(lock, 10ms, [&](){return running_==false;});
+            drain(batch);
+        }
+        drain(batch);
+
+        uint64_t dropped = 0;
+        threads_.for_each([&](const ThreadState& t){
+            EventRing* ring = t.events.load(std::memory_order_acquire);
+            if (ring != nullptr) {
+                dropped += ring->dropped.load(std::memory_order_relaxed);
+            }
+        });
+        if (dropped > 0) {
+            fprintf(stderr, "mem-scope-track: dropped %llu events, consider "
+                            "MEMSCOPETRACK_EVENTS_BUFFER or MEMSCOPETRACK_EVENTS_POLICY=block\n",
+                    static_cast<unsigned long long>(dropped));
+        }
+    }
+
+
+    uint32_t
+    StackTable::intern(void* const* frames, int depth)
+    {
+        Key key;
+        key.depth = std::min(depth, MAX_DEPTH);
+        std::copy(frames, frames+key.depth, key.frames.begin());
+
+        std::lock_guard<std::mutex> lock(guard_);
+        auto iter = ids_.find(key);
+        if (iter != ids_.end()) {
+            return iter->second;
+        }
+        // outermost frame first, like folded flame graph stacks
+        std::string name("stack:");
+        for(int i=key.depth-1;i>=0;i--) {
+            name += frame_name(key.frames[i]);
+            if (i > 0) {
+                name += ';';
+            }
+        }
+        // demangled names may contain '/', as in operator/
+        uint32_t id = scopes_.intern(name, false);
+        ids_.emplace(key, id);
+        return id;
+    }
+
+    std::string
+    StackTable::frame_name(void* addr)
+    {
+        // a return address points after the call, so look up the call itself
+        void* call = static_cast<char*>(addr) - 1;
+        Dl_info info;
+        if (dladdr(call, &info) == 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%p", addr);
+            return buf;
+        }
+        if (info.dli_sname != nullptr) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string ret(status == 0 && demangled ? demangled : info.dli_sname);
+            std::free(demangled);
+            return ret;
+        }
+        // no exported symbol, as for most functions in an executable
+        const char* file = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        file = file ? file+1 : (info.dli_fname ? info.dli_fname : "?");
+        char buf[32];
+        snprintf(buf, sizeof(buf), "+0x%zx",
+                 static_cast<size_t>(static_cast<char*>(call) - static_cast<char*>(info.dli_fbase)));
+        return std::string(file) + buf;
+    }
+
+
+    void
+    MappingTable::add(uintptr_t start, size_t length, uint32_t scope)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        remove_locked(start, length);
+        add_locked(start, length, scope);
+    }
+
+    void
+    MappingTable::remove(uintptr_t start, size_t length)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        remove_locked(start, length);
+    }
+
+    void
+    MappingTable::remap(uintptr_t old_start, size_t old_length, uintptr_t start, size_t length, bool keep_old)
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        auto iter = ranges_.upper_bound(old_start);
+        if (iter == ranges_.begin() || std::prev(iter)->second.end <= old_start) {
+            // not a tracked range, but it may have replaced tracked ones
+            // at a MREMAP_FIXED address
+            remove_locked(start, length);
+            return;
+        }
+        uint32_t scope = std::prev(iter)->second.scope;
+        // an old length of 0 duplicates a shared mapping instead of moving it
+        if (old_length != 0 && !keep_old) {
+            remove_locked(old_start, old_length);
+        }
+        remove_locked(start, length);
+        add_locked(start, length, scope);
+    }
+
+    std::vector<size_t>
+    MappingTable::get_extents() const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        return bytes_;
+    }
+
+    void
+    MappingTable::add_locked(uintptr_t start, size_t length, uint32_t scope)
+    {
+        if (length == 0) {
+            return;
+        }
+        ranges_.emplace(start, Range{start+length, scope});
+        if (scope >= bytes_.size()) {
+            bytes_.resize(scope+1, 0);
+        }
+        bytes_[scope] += length;
+    }
+
+    void
+    MappingTable::remove_locked(uintptr_t start, size_t length)
+    {
+        uintptr_t end = start + length;
+        auto iter = ranges_.upper_bound(start);
+        if (iter != ranges_.begin()) {
+            auto prev = std::prev(iter);
+            if (prev->second.end > start) {
+                iter = prev;
+            }
+        }
+        while (iter != ranges_.end() && iter->first < end) {
+            uintptr_t range_start = iter->first;
+            Range range = iter->second;
+            uintptr_t cut_start = std::max(range_start, start);
+            uintptr_t cut_end = std::min(range.end, end);
+            bytes_[range.scope] -= cut_end - cut_start;
+
+            if (range_start < start) {
+                // keep the part before the cut
+                iter->second.end = start;
+                ++iter;
+            } else {
+                iter = ranges_.erase(iter);
+            }
+            if (range.end > end) {
+                // keep the part after the cut
+                iter = ranges_.emplace_hint(iter, end, Range{range.end, range.scope});
+                ++iter;
+            }
+        }
+    }
+
+
+    QueryServer::QueryServer(std::string path, Tracking& t, Log& log)
+        : path_(path), tracking_(t), fd_(-1),
+          start_(std::chrono::steady_clock::now()), running_(true)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path)) {
+            log.print<Log::LEVEL::error>("socket path too long: %s\n", path_.c_str());
+            return;
+        }
+        strcpy(addr.sun_path, path_.c_str());
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(path_.c_str()); // left over from an earlier run
+        if (fd_ < 0 || bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+            || listen(fd_, 16) != 0) {
+            log.print<Log::LEVEL::error>("cannot listen on %s: %s\n", path_.c_str(), strerror(errno));
+            if (fd_ >= 0) {
+                close(fd_);
+                fd_ = -1;
+            }
+            return;
+        }
+        // listening already, so queries work as soon as main starts
+        thread_ = std::make_unique<std::thread>(&QueryServer::run, this);
+    }
+
+    QueryServer::~QueryServer()
+    {
+        running_ = false;
+        if (thread_) {
+            thread_->join();
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+            unlink(path_.c_str());
+        }
+    }
+
+    void
+    QueryServer::run()
+    {
+        RecursionGuard r;
+        while (running_) {
+            pollfd p{fd_, POLLIN, 0};
+            if (poll(&p, 1, 100) <= 0) {
+                continue; // timeout, to check running_
+            }
+            int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                answer(client);
+                close(client);
+            }
+        }
+    }
+
+    void
+    QueryServer::answer(int client)
+    {
+        // a stuck reader must not stall the server
+        timeval timeout{1, 0};
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Snapshot snapshot = tracking_.get_snapshot(false);
+        snapshot.usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start_).count();
+        if (tracking_.get_scope_count() > names_.size()) {
+            auto new_names = tracking_.get_scope_names(names_.size());
+            names_.insert(names_.end(), new_names.begin(), new_names.end());
+        }
+        std::string buf;
+        format_text(snapshot, names_, buf);
+        const char* pos = buf.data();
+        size_t left = buf.size();
+        while (left > 0) {
+            ssize_t n = send(client, pos, left, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            pos += n;
+            left -= n;
+        }
+    }
+
+
+    SharedSegment::SharedSegment(std::string name, Log& log)
+        : path_("/dev/shm/"+name), base_(nullptr), size_(0), header_(nullptr)
+    {
+        uint32_t capacity = 16384;
+        char* scopes = std::getenv("MEMSCOPETRACK_SHM_SCOPES");
+        if (scopes != nullptr && strtoul(scopes, nullptr, 10) > 0) {
+            capacity = strtoul(scopes, nullptr, 10);
+        }
+        auto align = [](size_t x){ return (x + 63) & ~size_t(63); };
+        size_t names_offset = align(sizeof(format::ShmHeader));
+        size_t names_size = size_t(capacity) * 64;
+        size_t values_offset = align(names_offset + names_size);
+        size_ = values_offset + size_t(capacity) * sizeof(format::ShmScope);
+
+        int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, size_) != 0) {
+            log.print<Log::LEVEL::error>("cannot create %s: %s\n", path_.c_str(), strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        void* base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            log.print<Log::LEVEL::error>("cannot map %s: %s\n", path_.c_str(), strerror(errno));
+            unlink(path_.c_str());
+            return;
+        }
+        base_ = static_cast<char*>(base);
+        header_ = reinterpret_cast<format::ShmHeader*>(base_);
+        header_->version = format::VERSION;
+        header_->capacity = capacity;
+        header_->names_offset = names_offset;
+        header_->names_size = names_size;
+        header_->values_offset = values_offset;
+        // magic last, so a reader never sees a half-initialized header
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header_->magic, format::SHM_MAGIC, sizeof(format::SHM_MAGIC));
+    }
+
+    SharedSegment::~SharedSegment()
+    {
+        if (base_ != nullptr) {
+            munmap(base_, size_);
+            unlink(path_.c_str());
+        }
+    }
+
+    void
+    SharedSegment::publish(const Snapshot& snapshot, const std::vector<std::string>& names)
+    {
+        if (base_ == nullptr) {
+            return;
+        }
+        uint64_t seq = header_->seq;
+        store(header_->seq, seq+1);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        // append new names while there is room for them and their values
+        uint64_t used = header_->names_used;
+        char* names_area = base_ + header_->names_offset;
+        for(; defined_ < names.size() && defined_ < header_->capacity; defined_++) {
+            uint32_t length = names[defined_].size();
+            if (used + sizeof(length) + length > header_->names_size) {
+                break;
+            }
+            memcpy(names_area + used, &length, sizeof(length));
+            memcpy(names_area + used + sizeof(length), names[defined_].data(), length);
+            used += sizeof(length) + length;
+        }
+        store(header_->names_used, used);
+        store(header_->scopes, defined_);
+        store<uint64_t>(header_->truncated, names.size() > defined_ ? names.size() - defined_ : 0);
+
+        auto value = [&](const std::vector<size_t>& values, size_t id) -> uint64_t {
+            return id < values.size() ? values[id] : 0;
+        };
+        static const std::vector<size_t> none;
+        auto series = [&](uint64_t kind) -> const std::vector<size_t>& {
+            for(auto& s : snapshot.series) {
+                if (s.kind == kind) {
+                    return s.values;
+                }
+            }
+            return none;
+        };
+        auto& peak = series(format::PEAK);
+        auto& mapped = series(format::MAPPED);
+        auto& allocs = series(format::ALLOCS);
+        auto& frees = series(format::FREES);
+        auto& allocated = series(format::ALLOCATED);
+        auto* scopes = reinterpret_cast<format::ShmScope*>(base_ + header_->values_offset);
+        for(uint32_t id=1;id<defined_;id++) {
+            format::ShmScope& out = scopes[id];
+            store(out.heap, value(snapshot.heap, id));
+            store(out.peak, value(peak, id));
+            store(out.mapped, value(mapped, id));
+            store(out.allocs, value(allocs, id));
+            store(out.frees, value(frees, id));
+            store(out.allocated, value(allocated, id));
+        }
+        store<uint64_t>(header_->usec, snapshot.usec);
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        store(header_->seq, seq+2);
+    }
+
+
+    TrackingThread::TrackingThread(Tracking& t)
+        : running_(true), tracking_(t), min_interval_(100), max_interval_(100)
+    {
+        // MEMSCOPETRACK_INTERVAL is either <ms> or <min ms>:<max ms>
+        char* interval = std::getenv("MEMSCOPETRACK_INTERVAL");
+        if (interval != nullptr) {
+            char* end;
+            unsigned long long min = strtoull(interval, &end, 10);
+            unsigned long long max = min;
+            if (*end == ':') {
+                max = strtoull(end+1, nullptr, 10);
+            }
+            if (min > 0 && max >= min) {
+                min_interval_ = std::chrono::milliseconds(min);
+                max_interval_ = std::chrono::milliseconds(max);
+            }
+        }
+        tracking_thread_ = std::make_unique<std::thread>(&TrackingThread::run,this);
+    }
+
+    TrackingThread::~TrackingThread()
+    {
+        running_ = false;
+        tracking_thread_cv_.notify_all();
+        tracking_thread_->join();
+    }
+
+    void TrackingThread::run()
+    {
+        RecursionGuard r;
+        boost::filesystem::path p = boost::filesystem::absolute(tracking_.get_library_path());
+        p = p.parent_path();
+        p /= "python";
+        p /= "timeline.py";
+        std::string graph_cmd = "python " + p.string();
+        bool have_outfile = false;
+        {
+            using namespace std::chrono_literals;
+            auto start = std::chrono::high_resolution_clock::now();
+            std::unique_lock<std::mutex> lock(tracking_thread_cv_mutex_);
+
+            // MEMSCOPETRACK_OUTFILE=none keeps snapshots for the shared
+            // memory segment only
+            std::unique_ptr<Outfile> outfile;
+            std::unique_ptr<SnapshotWriter> writer;
+            char* outfile_name = std::getenv("MEMSCOPETRACK_OUTFILE");
+            if (outfile_name == nullptr) {
+                outfile = std::make_unique<RandomOutfile>();
+            } else if (strcmp(outfile_name, "none") != 0) {
+                outfile = std::make_unique<Outfile>(process_path(outfile_name));
+            }
+            if (outfile && !outfile->is_open()) {
+                outfile.reset(); // already reported, carry on without
+            }
+            if (outfile) {
+                graph_cmd += " " + outfile->get_filename();
+                writer = make_writer(*outfile);
+                have_outfile = true;
+            }
+
+            // scope names already fetched from the registry
+            std::vector<std::string> names;
+
+            auto print = [&](){
+                Snapshot snapshot = tracking_.get_snapshot();
+                auto now = std::chrono::high_resolution_clock::now();
+                snapshot.usec = std::chrono::duration_cast<std::chrono::microseconds>(now-start).count();
+                if (tracking_.get_scope_count() > names.size()) {
+                    auto new_names = tracking_.get_scope_names(names.size());
+                    names.insert(names.end(), new_names.begin(), new_names.end());
+                }
+                if (writer) {
+                    writer->write(snapshot, names);
+                }
+                tracking_.publish(snapshot, names);
+            };
+            size_t previous = tracking_.get_total();
+            print();
+
+            // Wake up every min interval, but only take a snapshot once the
+            // current interval is over or the heap total moved a lot. The
+            // total is cheap to read, unlike a full snapshot.
+            auto interval = min_interval_;
+            auto since = std::chrono::milliseconds(0);
+            // a stop before the first wait still gets its final snapshot
+            bool stopping = false;
+            while(!stopping) {
+                tracking_thread_cv_.wait_for(lock, min_interval_, [&](){return running_==false;});
+                stopping = !running_;
+                tracking_.tick();
+                since += min_interval_;
+                size_t total = tracking_.get_total();
+                double change = std::abs(static_cast<double>(total) - static_cast<double>(previous))
+                                / std::max<size_t>(previous, 1<<20);
+                if (!stopping && since < interval && change <= 0.05) {
+                    continue;
+                }
+                print();
+                interval = next_interval(interval, change);
+                previous = total;
+                since = std::chrono::milliseconds(0);
+            }
+        }
+
+        // call into python to make graph
+        if (have_outfile) {
+            std::cout << graph_cmd << "\n";
+        }
+        //system(graph_cmd);
+    }
+    
+
+    std::chrono::milliseconds
+    TrackingThread::next_interval(std::chrono::milliseconds interval, double change) const
+    {
+        // Go back to the fastest rate as soon as memory moves, and back
+        // off gradually while it stays flat. Peaks between snapshots are
+        // still caught by the peak series.
+        if (change > 0.05) {
+            return min_interval_;
+        }
+        if (change < 0.01) {
+            return std::min(interval*2, max_interval_);
+        }
+        return interval;
+    }
+
+
+    // NUMA node of each CPU, from sysfs; CPUs not listed are on node 0
+    std::vector<uint16_t>
+    read_cpu_nodes()
+    {
+        std::vector<uint16_t> nodes;
+        for(unsigned node=0;node<format::MAX_NODES;node++) {
+            std::ifstream f("/sys/devices/system/node/node"+std::to_string(node)+"/cpulist");
+            std::string list;
+            if (!f || !std::getline(f, list)) {
+                continue;
+            }
+            // ranges like "0-3,8-11"
+            const char* pos = list.c_str();
+            while (*pos != '\0') {
+                char* next;
+                unsigned long first = strtoul(pos, &next, 10);
+                if (next == pos) {
+                    break;
+                }
+                unsigned long last = first;
+                if (*next == '-') {
+                    pos = next+1;
+                    last = strtoul(pos, &next, 10);
+                }
+                for(unsigned long cpu=first;cpu<=last && cpu<65536;cpu++) {
+                    if (nodes.size() <= cpu) {
+                        nodes.resize(cpu+1, 0);
+                    }
+                    nodes[cpu] = node;
+                }
+                pos = *next == ',' ? next+1 : next;
+            }
+        }
+        return nodes;
+    }
+
+    // a byte count with an optional K, M or G suffix (powers of 1024)
+    bool
+    parse_bytes(const std::string& text, size_t& bytes)
+    {
+        char* end;
+        unsigned long long value = strtoull(text.c_str(), &end, 10);
+        if (end == text.c_str()) {
+            return false;
+        }
+        switch (*end) {
+            case 'k': case 'K': value <<= 10; end++; break;
+            case 'm': case 'M': value <<= 20; end++; break;
+            case 'g': case 'G': value <<= 30; end++; break;
+            default: break;
+        }
+        if (*end == 'b' || *end == 'B') {
+            end++;
+        }
+        bytes = value;
+        return *end == '\0';
+    }
+
+    Tracking::Tracking(std::shared_ptr<Log> log)
+        : log_(log), stacks_(scopes_), stats_(true), depth_(0), leaks_(0),
+          start_(std::chrono::steady_clock::now()), total_peak_(0)
+    {
+        char* depth = std::getenv("MEMSCOPETRACK_DEPTH");
+        if (depth != nullptr) {
+            depth_ = atoi(depth) > 0 ? atoi(depth) : 0;
+        }
+
+        char* leaks = std::getenv("MEMSCOPETRACK_LEAKS");
+        if (leaks != nullptr) {
+            leaks_ = atoi(leaks) > 0 ? atoi(leaks) : 0;
+        }
+
+        // allocation counts and size classes are always kept, but
+        // writing them can be turned off for smaller output
+        char* stats = std::getenv("MEMSCOPETRACK_STATS");
+        stats_ = stats == nullptr || strcmp(stats, "0") != 0;
+
+        // "thread", "node", or both, e.g. "thread,node"
+        char* breakdown = std::getenv("MEMSCOPETRACK_BREAKDOWN");
+        if (breakdown != nullptr) {
+            if (strstr(breakdown, "thread") != nullptr) {
+                threads_ = std::make_unique<Breakdown>();
+            }
+            if (strstr(breakdown, "node") != nullptr) {
+                nodes_ = std::make_unique<Breakdown>();
+                cpu_nodes_ = read_cpu_nodes();
+            }
+            char* header = std::getenv("MEMSCOPETRACK_HEADER");
+            if (header != nullptr && strcmp(header, "0") != 0) {
+                log_->print<Log::LEVEL::warn>("MEMSCOPETRACK_BREAKDOWN does not cover blocks "
+                                              "tagged with MEMSCOPETRACK_HEADER\n");
+            }
+        }
+
+        // "scope=bytes,...", and/or a file with a "scope=bytes" line per
+        // scope, for ones that have commas in their name
+        char* budgets = std::getenv("MEMSCOPETRACK_BUDGETS");
+        if (budgets != nullptr) {
+            read_budgets(budgets, ',', "MEMSCOPETRACK_BUDGETS");
+        }
+        char* budget_file = std::getenv("MEMSCOPETRACK_BUDGET_FILE");
+        if (budget_file != nullptr) {
+            std::ifstream f(budget_file);
+            if (f) {
+                std::string contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+                read_budgets(contents, '\n', budget_file);
+            } else {
+                log_->print<Log::LEVEL::warn>("cannot read MEMSCOPETRACK_BUDGET_FILE %s\n", budget_file);
+            }
+        }
+
+        char* preload = std::getenv("LD_PRELOAD");
+        if (preload == nullptr) {
+            fprintf(stderr, "failed to initialize preload path\n");
+            abort();
+        }
+        boost::filesystem::path p(preload);
+        library_path_ = p.string();
+
+        // start the tracking file
+        start();
+    }
+
+    uint32_t
+    Tracking::ticks() const
+    {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start_).count();
+        uint64_t ticks = static_cast<uint64_t>(ms) * AddressTable::TICKS_PER_SECOND / 1000;
+        return static_cast<uint32_t>(std::min(ticks, AddressTable::MAX_BIRTH));
+    }
+
+    void
+    Tracking::report_leaks()
+    {
+        RecursionGuard r;
+        // upper bounds of the age classes, in seconds
+        static constexpr unsigned AGES = 6;
+        static constexpr uint64_t AGE_LIMITS[AGES-1] = {1, 10, 60, 600, 3600};
+        static constexpr const char* AGE_NAMES[AGES] = {"<1s", "<10s", "<1m", "<10m", "<1h", "older"};
+        struct Group
+        {
+            uint64_t bytes = 0;
+            uint64_t blocks = 0;
+            std::array<uint64_t, AGES> ages{};
+
+            void add(const Group& other)
+            {
+                bytes += other.bytes;
+                blocks += other.blocks;
+                for(unsigned a=0;a<AGES;a++) {
+                    ages[a] += other.ages[a];
+                }
+            }
+        };
+
+        // Summing per worker and merging the summaries keeps this to one
+        // pass over the table, whose size is the only big number here.
+        uint64_t now = ticks();
+        unsigned workers = std::clamp<unsigned>(std::thread::hardware_concurrency(), 1, 16);
+        std::vector<std::unordered_map<uint64_t, Group>> partial(workers);
+        ptr_map_.for_each_parallel(workers, [&](unsigned worker, const AddressTable::Entry& e){
+            uint64_t key = (static_cast<uint64_t>(e.scope) << 8) | format::size_class(e.size);
+            Group& g = partial[worker][key];
+            g.bytes += e.size;
+            g.blocks++;
+            uint64_t age = e.birth < now ? (now - e.birth) / AddressTable::TICKS_PER_SECOND : 0;
+            unsigned a = 0;
+            while (a < AGES-1 && age >= AGE_LIMITS[a]) {
+                a++;
+            }
+            g.ages[a]++;
+        });
+        std::unordered_map<uint64_t, Group> groups = std::move(partial[0]);
+        for(unsigned w=1;w<workers;w++) {
+            for(auto& p : partial[w]) {
+                groups[p.first].add(p.second);
+            }
+        }
+        if (groups.empty()) {
+            return;
+        }
+
+        Group total;
+        std::vector<std::pair<uint64_t, Group>> sorted(groups.begin(), groups.end());
+        for(auto& g : sorted) {
+            total.add(g.second);
+        }
+        size_t shown = std::min<size_t>(leaks_, sorted.size());
+        std::partial_sort(sorted.begin(), sorted.begin()+shown, sorted.end(),
+                          [](const auto& a, const auto& b){
+            return a.second.bytes != b.second.bytes ? a.second.bytes > b.second.bytes : a.first < b.first;
+        });
+
+        auto ages = [&](const Group& g){
+            std::string out;
+            for(unsigned a=0;a<AGES;a++) {
+                out += (a ? ", " : "") + std::to_string(g.ages[a]) + " " + AGE_NAMES[a];
+            }
+            return out;
+        };
+        log_->print<Log::LEVEL::info>("Unfreed blocks: %llu bytes in %llu blocks; by age: %s\n",
+                                      static_cast<unsigned long long>(total.bytes),
+                                      static_cast<unsigned long long>(total.blocks),
+                                      ages(total).c_str());
+        auto names = scopes_.names(0);
+        for(size_t i=0;i<shown;i++) {
+            uint32_t scope = static_cast<uint32_t>(sorted[i].first >> 8);
+            unsigned size_class = static_cast<unsigned>(sorted[i].first & 0xff);
+            const Group& g = sorted[i].second;
+            log_->print<Log::LEVEL::info>("  %s size%u - %llu bytes in %llu blocks; by age: %s\n",
+                                          scope < names.size() ? names[scope].c_str() : "?", size_class,
+                                          static_cast<unsigned long long>(g.bytes),
+                                          static_cast<unsigned long long>(g.blocks),
+                                          ages(g).c_str());
+        }
+        if (shown < sorted.size()) {
+            log_->print<Log::LEVEL::info>("  (%zu more)\n", sorted.size() - shown);
+        }
+    }
+
+    Tracking::~Tracking()
+    {
+        tracking_enabled = false;
+        stop();
+        if (total_peak_ != 0 && log_) {
+            log_->print<Log::LEVEL::info>("Peak memory: %zu\n", total_peak_);
+            auto names = scopes_.names(0);
+            for(size_t id=1;id<peaks_.size();id++) {
+                if (peaks_[id] != 0) {
+                    log_->print<Log::LEVEL::info>("  %s - %zu\n", names[id].c_str(), peaks_[id]);
+                }
+            }
+        }
+
+        bool any_over = false;
+        for(auto& c : budgets_) {
+            BudgetChunk* chunk = c.load();
+            if (chunk == nullptr) {
+                continue;
+            }
+            for(auto& b : *chunk) {
+                Budget* budget = b.load();
+                if (budget != nullptr && budget->crossings != 0 && log_) {
+                    if (!any_over) {
+                        log_->print<Log::LEVEL::info>("Over budget:\n");
+                        any_over = true;
+                    }
+                    log_->print<Log::LEVEL::info>("  %s - %llu times over %lld bytes\n",
+                                                  scopes_.c_str(budget->scope),
+                                                  static_cast<unsigned long long>(budget->crossings.load()),
+                                                  static_cast<long long>(budget->limit.load()));
+                }
+                delete budget;
+            }
+            delete chunk;
+        }
+
+        auto mapped = mappings_.get_extents();
+        bool mapped_empty = true;
+        for(size_t id=1;id<mapped.size();id++) {
+            if (mapped[id] != 0) {
+                mapped_empty = false;
+                break;
+            }
+        }
+        if (!mapped_empty && log_) {
+            log_->print<Log::LEVEL::info>("Still mapped:\n");
+            auto names = scopes_.names(0);
+            for(size_t id=1;id<mapped.size();id++) {
+                if (mapped[id] != 0) {
+                    log_->print<Log::LEVEL::info>("  %s - %zu\n", names[id].c_str(), mapped[id]);
+                }
+            }
+        }
+
+        auto extents = get_extents();
+        bool empty = true;
+        for(size_t id=1;id<extents.size();id++) {
+            if (extents[id] != 0) {
+                empty = false;
+                break;
+            }
+        }
+        if (!empty && log_) {
+            log_->print<Log::LEVEL::info>("Unfreed memory:\n");
+            auto names = scopes_.names(0);
+            for(size_t id=1;id<extents.size();id++) {
+                if (extents[id] != 0) {
+                    log_->print<Log::LEVEL::info>("  %s - %zu\n", names[id].c_str(), extents[id]);
+                }
+            }
+            if (leaks_ > 0) {
+                report_leaks();
+            }
+        }
+
+        if (log_) {
+            arena::Stats overhead = arena::stats();
+            log_->print<Log::LEVEL::info>("Tracker overhead: %zu bytes mapped, %zu in use\n",
+                                          overhead.committed, overhead.in_use);
+            if (overhead.fallback != 0) {
+                log_->print<Log::LEVEL::warn>("%zu tracker allocations did not fit in "
+                                              "MEMSCOPETRACK_ARENA, and went to malloc\n",
+                                              overhead.fallback);
+            }
+        }
+    }
+
+    void
+    Tracking::start()
+    {
+        char* shm = std::getenv("MEMSCOPETRACK_SHM");
+        if (shm != nullptr) {
+            shm_ = std::make_unique<SharedSegment>(process_path(shm), *log_);
+        }
+        tracking_thread_ = std::make_unique<TrackingThread>(*this);
+        char* events = std::getenv("MEMSCOPETRACK_EVENTS");
+        if (events != nullptr) {
+            events_ = std::make_unique<EventRecorder>(process_path(events), scope_map_, scopes_);
+        }
+        char* socket = std::getenv("MEMSCOPETRACK_SOCKET");
+        if (socket != nullptr) {
+            query_ = std::make_unique<QueryServer>(process_path(socket), *this, *log_);
+        }
+    }
+
+    void
+    Tracking::stop()
+    {
+        tracking_thread_.reset();
+        events_.reset();
+        query_.reset();
+        shm_.reset();
+    }
+
+    void
+    Tracking::prepare_fork()
+    {
+        // outer locks first, in the order they nest
+        budgets_guard_.lock();
+        rollup_guard_.lock();
+        peaks_guard_.lock();
+        stacks_.lock();
+        scopes_.lock();
+        scope_map_.lock();
+        ptr_map_.lock();
+        mappings_.lock();
+        if (threads_) {
+            threads_->lock();
+        }
+        if (nodes_) {
+            nodes_->lock();
+        }
+    }
+
+    void
+    Tracking::parent_after_fork()
+    {
+        if (nodes_) {
+            nodes_->unlock();
+        }
+        if (threads_) {
+            threads_->unlock();
+        }
+        mappings_.unlock();
+        ptr_map_.unlock();
+        scope_map_.unlock();
+        scopes_.unlock();
+        stacks_.unlock();
+        peaks_guard_.unlock();
+        rollup_guard_.unlock();
+        budgets_guard_.unlock();
+    }
+
+    void
+    Tracking::child_after_fork()
+    {
+        parent_after_fork();
+        scope_map_.after_fork();
+    }
+
+    void
+    Tracking::restart()
+    {
+        // the threads did not survive the fork, so these cannot be
+        // stopped, only abandoned
+        tracking_thread_.release();
+        events_.release();
+        query_.release();
+        shm_.release();
+        log_->after_fork();
+        {
+            std::lock_guard<std::mutex> lock(peaks_guard_);
+            std::fill(peaks_.begin(), peaks_.end(), 0);
+            total_peak_ = 0;
+        }
+        start();
+    }
+
+    Budget*
+    Tracking::add(void* addr, uint32_t scope, size_t size)
+    {
+        auto& local = scope_map_.local();
+        AddressTable::Entry entry{size, now_.load(std::memory_order_relaxed), scope, 0, 0};
+        if (threads_) {
+            entry.thread = thread_key(local);
+        }
+        if (nodes_) {
+            entry.node = current_node();
+        }
+        AddressTable::Entry prev;
+        if (ptr_map_.insert(addr, entry, prev)) {
+            local.alloc(scope, size);
+            if (threads_) {
+                threads_->add(entry.thread, scope, size);
+            }
+            if (nodes_) {
+                nodes_->add(entry.node, scope, size);
+            }
+            if (events_) {
+                events_->record(local, format::ALLOC, addr, scope, size);
+            }
+            if (any_budget_.load(std::memory_order_relaxed)) {
+                return charge(local, scope, size);
+            }
+        } else if (log_->enabled<Log::LEVEL::warn>()) {
+            log_->print<Log::LEVEL::warn>("duplicate memory address %p for %8zu bytes in scope %s\n", addr, size, scopes_.name(scope).c_str());
+            log_->print<Log::LEVEL::warn>("    previous allocation:                %8zu bytes in scope %s\n", static_cast<size_t>(prev.size), scopes_.name(prev.scope).c_str());
+        }
+        return nullptr;
+    }
+
+    void
+    Tracking::remove(void* addr)
+    {
+        AddressTable::Entry entry;
+        if (ptr_map_.erase(addr, entry)) {
+            auto& local = scope_map_.local();
+            local.free(entry.scope, entry.size);
+            if (threads_) {
+                threads_->add(entry.thread, entry.scope, -static_cast<int64_t>(entry.size));
+            }
+            if (nodes_) {
+                nodes_->add(entry.node, entry.scope, -static_cast<int64_t>(entry.size));
+            }
+            if (events_) {
+                events_->record(local, format::FREE, addr, entry.scope, entry.size);
+            }
+            if (any_budget_.load(std::memory_order_relaxed)) {
+                charge(local, entry.scope, -static_cast<int64_t>(entry.size));
+            }
+        }
+    }
+
+    Budget*
+    Tracking::add_tagged(void* addr, uint32_t scope, size_t size)
+    {
+        auto& local = scope_map_.local();
+        local.alloc(scope, size);
+        if (events_) {
+            events_->record(local, format::ALLOC, addr, scope, size);
+        }
+        if (any_budget_.load(std::memory_order_relaxed)) {
+            return charge(local, scope, size);
+        }
+        return nullptr;
+    }
+
+    void
+    Tracking::remove_tagged(void* addr, uint32_t scope, size_t size)
+    {
+        auto& local = scope_map_.local();
+        local.free(scope, size);
+        if (events_) {
+            events_->record(local, format::FREE, addr, scope, size);
+        }
+        if (any_budget_.load(std::memory_order_relaxed)) {
+            charge(local, scope, -static_cast<int64_t>(size));
+        }
+    }
+
+    Budget*
+    Tracking::charge(ThreadState& local, uint32_t scope, int64_t delta)
+    {
+        Budget* b = budget(scope);
+        if (b == nullptr) {
+            return nullptr;
+        }
+        int64_t limit = b->limit.load(std::memory_order_relaxed);
+        if (limit == 0) {
+            return nullptr;
+        }
+        // the orphan state is shared, so it adds every change right away
+        if (!local.shared) {
+            auto& c = local.get(scope);
+            c.budget += delta;
+            int64_t step = b->step(limit);
+            if (c.budget < step && c.budget > -step) {
+                return nullptr;
+            }
+            delta = c.budget;
+            c.budget = 0;
+        }
+        int64_t bytes = b->bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+        if (bytes > limit) {
+            if (!b->over.load(std::memory_order_relaxed)
+                && !b->over.exchange(true, std::memory_order_relaxed)) {
+                b->crossings.fetch_add(1, std::memory_order_relaxed);
+                return b;
+            }
+        } else if (b->over.load(std::memory_order_relaxed)) {
+            b->over.store(false, std::memory_order_relaxed);
+        }
+        return nullptr;
+    }
+
+    void
+    Tracking::set_budget(uint32_t scope, size_t limit, memory::BudgetCallback callback, void* arg)
+    {
+        size_t index = scope >> ThreadState::CHUNK_BITS;
+        if (scope == 0 || index >= ThreadState::MAX_CHUNKS) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(budgets_guard_);
+        BudgetChunk* chunk = budgets_[index].load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new BudgetChunk{};
+            budgets_[index].store(chunk, std::memory_order_release);
+        }
+        auto& slot = (*chunk)[scope & (ThreadState::CHUNK_SIZE-1)];
+        Budget* b = slot.load(std::memory_order_relaxed);
+        if (b == nullptr) {
+            b = new Budget;
+            b->scope = scope;
+            slot.store(b, std::memory_order_release);
+        }
+        b->callback = callback;
+        b->arg = arg;
+        if (b->limit.load() == 0 && limit != 0) {
+            // start from the bytes the scope holds now
+            auto extents = get_extents();
+            b->bytes = scope < extents.size() ? extents[scope] : 0;
+            b->over = false;
+        }
+        b->limit = static_cast<int64_t>(limit);
+        any_budget_ = true;
+    }
+
+    void
+    Tracking::notify(Budget& b)
+    {
+        memory::BudgetCallback callback;
+        void* arg;
+        const char* name;
+        {
+            RecursionGuard r;
+            std::lock_guard<std::mutex> lock(budgets_guard_);
+            callback = b.callback;
+            arg = b.arg;
+            name = scopes_.c_str(b.scope);
+        }
+        size_t bytes = std::max<int64_t>(0, b.bytes.load());
+        size_t limit = b.limit.load();
+        if (callback != nullptr) {
+            callback(name, bytes, limit, arg);
+        } else {
+            RecursionGuard r;
+            log_->print<Log::LEVEL::warn>("scope %s is over its budget: %zu of %zu bytes\n",
+                                          name, bytes, limit);
+        }
+    }
+
+    void
+    Tracking::read_budgets(const std::string& list, char separator, const char* source)
+    {
+        auto trim = [](const std::string& text) {
+            size_t first = text.find_first_not_of(" \t\r");
+            if (first == std::string::npos) {
+                return std::string();
+            }
+            return text.substr(first, text.find_last_not_of(" \t\r")-first+1);
+        };
+        size_t pos = 0;
+        while (pos <= list.size()) {
+            size_t end = list.find(separator, pos);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            std::string item = trim(list.substr(pos, end-pos));
+            pos = end+1;
+            if (item.empty() || item[0] == '#') {
+                continue;
+            }
+            // the last '=', as scope names may have one
+            size_t eq = item.rfind('=');
+            size_t limit;
+            if (eq == std::string::npos || eq == 0 || !parse_bytes(trim(item.substr(eq+1)), limit)) {
+                log_->print<Log::LEVEL::warn>("%s: ignoring budget \"%s\"\n", source, item.c_str());
+                continue;
+            }
+            set_budget(scopes_.intern(trim(item.substr(0, eq))), limit, nullptr, nullptr);
+        }
+    }
+
+    
+    std::vector<size_t>
+    Tracking::get_extents() const
+    {
+        auto stats = scope_map_.merge();
+        // tables grow in steps, so trim or pad to the registered scopes
+        std::vector<size_t> ret(scopes_.size());
+        for(size_t id=0;id<ret.size() && id<stats.size();id++) {
+            ret[id] = stats[id].bytes < 0 ? 0 : static_cast<size_t>(stats[id].bytes);
+        }
+        return ret;
+    }
+
+    Snapshot
+    Tracking::get_snapshot(bool reset_peaks)
+    {
+        auto stats = scope_map_.merge(reset_peaks);
+        // tables grow in steps, so trim or pad to the registered scopes
+        stats.resize(scopes_.size());
+
+        Snapshot ret;
+        ret.heap.resize(stats.size());
+        ret.series.push_back(Snapshot::Series{format::MAPPED, mappings_.get_extents()});
+        if (stats_) {
+            auto add_series = [&](uint8_t kind, auto value){
+                Snapshot::Series series{kind, std::vector<size_t>(stats.size())};
+                for(size_t id=0;id<stats.size();id++) {
+                    series.values[id] = value(stats[id]);
+                }
+                ret.series.push_back(std::move(series));
+            };
+            add_series(format::ALLOCS, [](const ScopeStats& s){ return s.allocs; });
+            add_series(format::FREES, [](const ScopeStats& s){ return s.frees; });
+            add_series(format::ALLOCATED, [](const ScopeStats& s){ return s.allocated; });
+            for(unsigned c=0;c<format::SIZE_CLASSES;c++) {
+                add_series(format::SIZES+c, [c](const ScopeStats& s){ return s.sizes[c]; });
+            }
+        }
+        for(size_t id=0;id<stats.size();id++) {
+            ret.heap[id] = stats[id].bytes < 0 ? 0 : static_cast<size_t>(stats[id].bytes);
+        }
+
+        // Each thread keeps the high-water mark of its own share, so the
+        // sum is exact for a scope used by one thread, and an upper bound
+        // when several threads allocate and free in it at once.
+        Snapshot::Series peak{format::PEAK, std::vector<size_t>(stats.size())};
+        size_t total = 0;
+        {
+            std::lock_guard<std::mutex> lock(peaks_guard_);
+            peaks_.resize(std::max(peaks_.size(), stats.size()), 0);
+            for(size_t id=1;id<stats.size();id++) {
+                size_t high = stats[id].high < 0 ? 0 : static_cast<size_t>(stats[id].high);
+                peak.values[id] = std::max(high, ret.heap[id]);
+                peaks_[id] = std::max(peaks_[id], peak.values[id]);
+                total += peak.values[id];
+            }
+            total_peak_ = std::max(total_peak_, total);
+        }
+        ret.series.push_back(std::move(peak));
+
+        // a thread id can come back after its thread exited, so keys
+        // with the same series kind are summed
+        auto add_breakdown = [&](Breakdown* breakdown, auto kind_of){
+            if (!breakdown) {
+                return;
+            }
+            std::map<uint64_t, std::vector<size_t>> by_kind;
+            for(auto& column : breakdown->collect(stats.size(), reset_peaks)) {
+                auto& values = by_kind[kind_of(column.first)];
+                if (values.empty()) {
+                    values = std::move(column.second);
+                } else {
+                    for(size_t id=0;id<values.size();id++) {
+                        values[id] += column.second[id];
+                    }
+                }
+            }
+            for(auto& s : by_kind) {
+                ret.series.push_back(Snapshot::Series{s.first, std::move(s.second)});
+            }
+        };
+        add_breakdown(threads_.get(), [&](uint32_t key){
+            return format::THREADS + (key == 0 ? 0 : thread_ids_[key].load(std::memory_order_relaxed));
+        });
+        add_breakdown(nodes_.get(), [](uint32_t key){ return format::NODES + key; });
+
+        if (depth_ > 0) {
+            roll_up(ret);
+        }
+        return ret;
+    }
+
+    uint16_t
+    Tracking::thread_key(ThreadState& local)
+    {
+        if (local.origin == 0 && !local.shared) {
+            // threads past the limit, and the orphan state, share key 0
+            uint32_t key = next_thread_key_.load(std::memory_order_relaxed);
+            while (key < Breakdown::MAX_KEYS
+                   && !next_thread_key_.compare_exchange_weak(key, key+1, std::memory_order_relaxed)) { }
+            if (key < Breakdown::MAX_KEYS) {
+                thread_ids_[key].store(local.thread, std::memory_order_relaxed);
+                local.origin = key;
+            }
+        }
+        return static_cast<uint16_t>(local.origin);
+    }
+
+    void
+    Tracking::roll_up(Snapshot& snapshot)
+    {
+        std::lock_guard<std::mutex> lock(rollup_guard_);
+        // parents are always interned before their children
+        auto parents = scopes_.parents(rollup_.size());
+        for(auto parent : parents) {
+            uint32_t id = static_cast<uint32_t>(rollup_.size());
+            unsigned depth = id == 0 ? 0 : depths_[parent]+1;
+            depths_.push_back(depth);
+            rollup_.push_back(depth <= depth_ ? id : rollup_[parent]);
+        }
+
+        auto sum = [&](std::vector<size_t>& values){
+            std::vector<size_t> out(values.size(), 0);
+            for(size_t id=0;id<values.size() && id<rollup_.size();id++) {
+                out[rollup_[id]] += values[id];
+            }
+            values.swap(out);
+        };
+        sum(snapshot.heap);
+        for(auto& series : snapshot.series) {
+            sum(series.values);
+        }
+    }
+
+} // end anon namespace
+
+namespace memory {
+    // Created by init and deleted by destroy. Static destructors would
+    // be registered after destroy, and so run before it.
+    static Log* log = nullptr;
+    static Tracking* map = nullptr;
+
+    __thread ThreadContext context;
+
+    std::atomic<bool> any_tracked(false);
+
+    // per-thread cache of recently used scope names, keyed by the address
+    // of the caller's string so that string literals hit without a lookup
+    class NameCache
+    {
+    public:
+        inline uint32_t lookup(const char* s)
+        {
+            Entry& e = entries_[(reinterpret_cast<uintptr_t>(s) >> 3) % SIZE];
+            if (e.key == s && e.name != nullptr && strcmp(s, e.name) == 0) {
+                return e.id;
+            }
+            RecursionGuard r;
+            uint32_t id = map->get_scope_id(s);
+            e.key = s;
+            e.name = map->get_scope_name(id);
+            e.id = id;
+            return id;
+        }
+    private:
+        static constexpr size_t SIZE = 64;
+        struct Entry
+        {
+            const char* key;
+            const char* name;
+            uint32_t id;
+        };
+        Entry entries_[SIZE] = {};
+    };
+    static thread_local NameCache name_cache;
 
-namespace memory {
-    std::string scope;
     void set_scope(std::string s)
     {
         RecursionGuard r;
-        scope = s;
+        if (map) {
+            context.scope = map->get_scope_id(s);
+        }
+    }
+
+    void set_scope(const char* s)
+    {
+        if (map) {
+            context.scope = name_cache.lookup(s);
+        }
+    }
+
+    void set_scope(ScopeHandle h)
+    {
+        context.scope = h.id;
+    }
+
+    ScopeHandle get_scope_handle(const char* s)
+    {
+        RecursionGuard r;
+        if (!map) {
+            return ScopeHandle{0};
+        }
+        return ScopeHandle{map->get_scope_id(s)};
+    }
+
+    ScopeHandle get_scope()
+    {
+        return ScopeHandle{context.scope};
+    }
+
+    // Scopes entered with push_scope, to return to on pop_scope. Deeper
+    // nesting than this is still handled, by asking the registry for the
+    // parent on the way out.
+    static constexpr unsigned MAX_NESTING = 64;
+    static thread_local uint32_t scope_stack[MAX_NESTING];
+    static thread_local unsigned scope_depth = 0;
+
+    // per-thread cache of child scopes, keyed by parent and the address
+    // of the caller's string
+    class ChildCache
+    {
+    public:
+        inline uint32_t lookup(uint32_t parent, const char* s)
+        {
+            Entry& e = entries_[((reinterpret_cast<uintptr_t>(s) >> 3) ^ parent) % SIZE];
+            if (e.key == s && e.parent == parent && e.name != nullptr
+                && strcmp(s, e.name) == 0) {
+                return e.id;
+            }
+            RecursionGuard r;
+            uint32_t id = map->get_child_scope_id(parent, s);
+            const char* name = map->get_scope_name(id);
+            e.key = s;
+            e.parent = parent;
+            // the cached copy of s is the last path component
+            const char* slash = strrchr(name, '/');
+            e.name = slash ? slash+1 : name;
+            e.id = id;
+            return id;
+        }
+    private:
+        static constexpr size_t SIZE = 64;
+        struct Entry
+        {
+            const char* key;
+            const char* name;
+            uint32_t parent;
+            uint32_t id;
+        };
+        Entry entries_[SIZE] = {};
+    };
+    static thread_local ChildCache child_cache;
+
+    void push_scope(const char* s)
+    {
+        if (!map) {
+            return;
+        }
+        if (scope_depth < MAX_NESTING) {
+            scope_stack[scope_depth] = context.scope;
+        }
+        scope_depth++;
+        context.scope = child_cache.lookup(context.scope, s);
+    }
+
+    void pop_scope()
+    {
+        if (scope_depth == 0) {
+            return; // unbalanced pop
+        }
+        scope_depth--;
+        if (scope_depth < MAX_NESTING) {
+            context.scope = scope_stack[scope_depth];
+        } else if (map) {
+            RecursionGuard r;
+            context.scope = map->get_parent_scope_id(context.scope);
+        }
+    }
+
+    // mean bytes between samples, or 0 to track every allocation
+    static size_t sample_mean = 0;
+    static thread_local Sampler sampler;
+
+    // frames kept for allocations outside any scope, or 0 to ignore them
+    static int stack_depth = 0;
+
+    // address range of this library, whose frames are left off stacks
+    static uintptr_t self_start = 0;
+    static uintptr_t self_end = 0;
+
+    static void find_self()
+    {
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void*>(&find_self), &info) == 0) {
+            return;
+        }
+        self_start = reinterpret_cast<uintptr_t>(info.dli_fbase);
+        dl_iterate_phdr([](struct dl_phdr_info* phdr, size_t, void*) -> int {
+            if (phdr->dlpi_addr != self_start) {
+                return 0;
+            }
+            for(int i=0;i<phdr->dlpi_phnum;i++) {
+                const auto& seg = phdr->dlpi_phdr[i];
+                if (seg.p_type == PT_LOAD) {
+                    self_end = std::max<uintptr_t>(self_end, phdr->dlpi_addr + seg.p_vaddr + seg.p_memsz);
+                }
+            }
+            return 1;
+        }, nullptr);
+    }
+
+    // per-thread cache of recent stacks, so repeated call sites skip the
+    // shared stack table
+    class StackCache
+    {
+    public:
+        inline uint32_t lookup(void* const* frames, int depth)
+        {
+            uint64_t h = depth;
+            for(int i=0;i<depth;i++) {
+                h = (h ^ reinterpret_cast<uintptr_t>(frames[i])) * 0x9E3779B97F4A7C15ull;
+            }
+            Entry& e = entries_[(h >> 32) % SIZE];
+            if (e.id != 0 && e.hash == h && e.depth == depth
+                && std::equal(frames, frames+depth, e.frames)) {
+                return e.id;
+            }
+            uint32_t id = map->get_stack_id(frames, depth);
+            e.hash = h;
+            e.depth = depth;
+            std::copy(frames, frames+depth, e.frames);
+            e.id = id;
+            return id;
+        }
+    private:
+        static constexpr size_t SIZE = 64;
+        struct Entry
+        {
+            uint64_t hash;
+            void* frames[StackTable::MAX_DEPTH];
+            int depth;
+            uint32_t id;
+        };
+        Entry entries_[SIZE] = {};
+    };
+    static thread_local StackCache stack_cache;
+
+    // get the synthetic scope of the calling stack
+    static uint32_t stack_scope()
+    {
+        void* frames[StackTable::MAX_DEPTH + 8];
+        int n = backtrace(frames, stack_depth + 8);
+        int skip = 0;
+        while (skip < n && reinterpret_cast<uintptr_t>(frames[skip]) >= self_start
+               && reinterpret_cast<uintptr_t>(frames[skip]) < self_end) {
+            skip++;
+        }
+        int depth = std::min(n - skip, stack_depth);
+        if (depth <= 0) {
+            return 0;
+        }
+        return stack_cache.lookup(frames+skip, depth);
+    }
+
+    // set in a forked child until its tracker has restarted
+    static std::atomic<bool> restart_pending(false);
+
+    // whether exec'd children are tracked too, with MEMSCOPETRACK_FOLLOW_EXEC
+    static bool follow = false;
+
+    static void prepare_fork()
+    {
+        if (map) {
+            map->prepare_fork();
+        }
+        arena::lock();
+    }
+
+    static void parent_after_fork()
+    {
+        arena::unlock();
+        if (map) {
+            map->parent_after_fork();
+        }
+    }
+
+    // Only the forking thread lives on in the child. Restarting the
+    // tracker, with new threads and files, waits for the first tracked
+    // call, so a child that just execs pays for none of it.
+    static void child_after_fork()
+    {
+        arena::unlock();
+        if (map) {
+            map->child_after_fork();
+            snprintf(process_suffix, sizeof(process_suffix), ".%d", static_cast<int>(getpid()));
+            if (tracking_enabled) {
+                tracking_enabled = false;
+                restart_pending = true;
+            }
+        }
+    }
+
+    static bool restart()
+    {
+        static std::mutex restart_guard;
+        std::lock_guard<std::mutex> lock(restart_guard);
+        if (restart_pending) {
+            map->restart();
+            restart_pending = false;
+            tracking_enabled = true;
+        }
+        return tracking_enabled;
+    }
+
+    // whether to track, restarting in a forked child if need be
+    static inline bool enabled()
+    {
+        return tracking_enabled || (restart_pending && restart());
     }
-    
-    static std::shared_ptr<Log> log;
-    static std::unique_ptr<Tracking> map;
 
     // destroy
     void destroy()
     {
+        if (restart_pending) {
+            // a forked child that never tracked anything still has the
+            // parent's threads, which cannot be joined
+            tracking_enabled = false;
+            return;
+        }
         tracking_enabled = false;
-        map.reset();
-        log.reset();
+        any_tracked = false;
+        delete map;
+        map = nullptr;
+        log = nullptr; // owned by the Tracking
     }
 
     // initialize the library
     void init()
     {
-        log = std::make_shared<Log>();
-        map = std::make_unique<Tracking>(log);
+        char* sample = std::getenv("MEMSCOPETRACK_SAMPLE");
+        if (sample != nullptr) {
+            sample_mean = strtoull(sample, nullptr, 10);
+        }
+
+        // The first process is the root of the tree, and the others
+        // write to files of their own. The pid survives exec, so a forked
+        // child that execs keeps its name.
+        char* follow_exec = std::getenv("MEMSCOPETRACK_FOLLOW_EXEC");
+        follow = follow_exec != nullptr && strcmp(follow_exec, "0") != 0;
+        if (follow) {
+            char* root = std::getenv("MEMSCOPETRACK_ROOT");
+            if (root != nullptr && atoi(root) != getpid()) {
+                snprintf(process_suffix, sizeof(process_suffix), ".%d", static_cast<int>(getpid()));
+            } else {
+                setenv("MEMSCOPETRACK_ROOT", std::to_string(getpid()).c_str(), 1);
+            }
+        }
+
+        auto shared_log = std::make_shared<Log>();
+        log = shared_log.get();
+        map = new Tracking(shared_log);
+
+        char* stacks = std::getenv("MEMSCOPETRACK_STACKS");
+        if (stacks != nullptr) {
+            // anything but a depth leaves the stacks off, since a depth
+            // other than 0 sends every unscoped allocation to the slow path
+            char* end;
+            long depth = strtol(stacks, &end, 10);
+            if (end == stacks || *end != '\0' || depth < 0) {
+                log->print<Log::LEVEL::warn>("ignoring MEMSCOPETRACK_STACKS=%s, which is not a stack depth\n", stacks);
+            } else {
+                stack_depth = static_cast<int>(std::min<long>(depth, StackTable::MAX_DEPTH));
+            }
+        }
+        if (stack_depth > 0) {
+            find_self();
+            // the first backtrace loads the unwinder, which allocates
+            void* frames[1];
+            backtrace(frames, 1);
+        }
         tracking_enabled = true;
         std::atexit(destroy);
+        pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
     }
 
-    void track(void* addr, size_t size)
+    bool track_unscoped()
+    {
+        return stack_depth != 0;
+    }
+
+    bool follow_exec()
+    {
+        return follow;
+    }
+
+    void set_scope_budget(const char* s, size_t budget, BudgetCallback callback, void* arg)
     {
         RecursionGuard r;
-        if (r.recursion or !tracking_enabled)
-            return; // no tracking on recursion
+        if (map) {
+            map->set_budget(map->get_scope_id(s), budget, callback, arg);
+        }
+    }
 
-        log->print("tracking addr 0x%08x with size %8u bytes in scope %s\n", addr, size, scope.c_str());
-        if (!scope.empty()) {
-            map->add(addr,scope,size);
+    void track(void* addr, size_t size)
+    {
+        Budget* over = nullptr;
+        {
+            RecursionGuard r;
+            if (r.recursion or !enabled())
+                return; // no tracking on recursion
+
+            if (log->enabled<Log::LEVEL::debug>()) {
+                log->print<Log::LEVEL::debug>("tracking addr %p with size %8zu bytes in scope %u\n", addr, size, context.scope);
+            }
+            if (context.scope != 0 || stack_depth != 0) {
+                if (sample_mean != 0) {
+                    size = sampler.sample(size, sample_mean);
+                    if (size == 0) {
+                        return; // not sampled
+                    }
+                }
+                uint32_t id = context.scope != 0 ? context.scope : stack_scope();
+                if (id != 0) {
+                    if (!any_tracked.load(std::memory_order_relaxed)) {
+                        any_tracked.store(true, std::memory_order_relaxed);
+                    }
+                    over = map->add(addr,id,size);
+                }
+            }
+        }
+        // the callback is application code, so it runs unguarded
+        if (over != nullptr) {
+            map->notify(*over);
         }
     }
 
     void release(void* addr)
     {
         RecursionGuard r;
-        if (r.recursion or !tracking_enabled)
+        if (r.recursion or !enabled())
             return; // no tracking on recursion
 
-        log->print("release addr 0x%08x\n", addr);
+        if (log->enabled<Log::LEVEL::debug>()) {
+            log->print<Log::LEVEL::debug>("release addr %p\n", addr);
+        }
         map->remove(addr);
     }
 
+    void track_mapping(void* addr, size_t length)
+    {
+        RecursionGuard r;
+        if (r.recursion or !enabled())
+            return; // no tracking on recursion
+
+        log->print<Log::LEVEL::debug>("tracking mapping %p with length %8zu bytes in scope %u\n", addr, length, context.scope);
+        if (context.scope != 0) {
+            map->add_mapping(addr,length,context.scope);
+        }
+    }
+
+    void release_mapping(void* addr, size_t length)
+    {
+        RecursionGuard r;
+        if (r.recursion or !enabled())
+            return; // no tracking on recursion
+
+        log->print<Log::LEVEL::debug>("release mapping %p with length %8zu bytes\n", addr, length);
+        map->remove_mapping(addr,length);
+    }
+
+    void remap(void* old_addr, size_t old_length, void* addr, size_t length, bool keep_old)
+    {
+        RecursionGuard r;
+        if (r.recursion or !enabled())
+            return; // no tracking on recursion
+
+        log->print<Log::LEVEL::debug>("remap %p to %p with length %8zu bytes\n", old_addr, addr, length);
+        map->remap(old_addr,old_length,addr,length,keep_old);
+    }
+
+    uint32_t track_tagged(void* addr, size_t size, size_t& accounted)
+    {
+        accounted = 0;
+        uint32_t id = 0;
+        Budget* over = nullptr;
+        {
+            RecursionGuard r;
+            if (r.recursion or !enabled())
+                return 0; // no tracking on recursion
+
+            if (log->enabled<Log::LEVEL::debug>()) {
+                log->print<Log::LEVEL::debug>("tracking tagged block with size %8zu bytes in scope %u\n", size, context.scope);
+            }
+            if (context.scope != 0 || stack_depth != 0) {
+                if (sample_mean != 0) {
+                    size = sampler.sample(size, sample_mean);
+                    if (size == 0) {
+                        return 0; // not sampled
+                    }
+                }
+                id = context.scope != 0 ? context.scope : stack_scope();
+                if (id != 0) {
+                    over = map->add_tagged(addr,id,size);
+                    accounted = size;
+                }
+            }
+        }
+        if (over != nullptr) {
+            map->notify(*over);
+        }
+        return accounted ? id : 0;
+    }
+
+    void release_tagged(void* addr, uint32_t id, size_t size)
+    {
+        RecursionGuard r;
+        if (r.recursion or !enabled())
+            return; // no tracking on recursion
+
+        if (log->enabled<Log::LEVEL::debug>()) {
+            log->print<Log::LEVEL::debug>("release tagged block with size %8zu bytes in scope %u\n", size, id);
+        }
+        if (id != 0) {
+            map->remove_tagged(addr,id,size);
+        }
+    }
+
 } // end namespace memory
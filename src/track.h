@@ -1,10 +1,62 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <atomic>
 
 namespace memory {
+    // per-thread state the allocation overloads check on every call,
+    // kept together so that is a single TLS access
+    struct ThreadContext
+    {
+        uint32_t scope;     // current scope, 0 outside any scope
+        bool in_tracker;    // running tracker code, whose allocations
+                            // belong to the arena and are not tracked
+    };
+    // __thread, not thread_local: an extern thread_local is reached
+    // through an init function call on every access
+    extern __thread ThreadContext context;
+
+    // set once a block has gone into the address table, and cleared when
+    // the tracker is destroyed; until then free has nothing to release
+    extern std::atomic<bool> any_tracked;
+
+    struct ScopeHandle
+    {
+        uint32_t id;
+    };
+
     void set_scope(std::string s);
+    void set_scope(const char* s);
+    void set_scope(ScopeHandle h);
+    ScopeHandle get_scope_handle(const char* s);
+    ScopeHandle get_scope();
+    void push_scope(const char* s);
+    void pop_scope();
+    typedef void (*BudgetCallback)(const char* scope, size_t bytes, size_t budget, void* arg);
+    void set_scope_budget(const char* s, size_t budget, BudgetCallback callback, void* arg);
     void init();
+
+    // whether allocations outside any scope are tracked too, for stack
+    // attribution; fixed once init has run
+    bool track_unscoped();
+
+    // whether exec'd children are tracked too, so LD_PRELOAD is kept;
+    // fixed once init has run
+    bool follow_exec();
+
     void track(void* addr, size_t size);
     void release(void* addr);
-}
\ No newline at end of file
+
+    // mmap'd ranges, with lengths rounded up to whole pages
+    void track_mapping(void* addr, size_t length);
+    void release_mapping(void* addr, size_t length);
+    // keep_old for MREMAP_DONTUNMAP, which leaves the old range mapped
+    void remap(void* old_addr, size_t old_length, void* addr, size_t length, bool keep_old);
+
+    // tracking without the address table, for blocks that carry their
+    // own scope and size; track_tagged returns the scope and the number
+    // of bytes accounted to it, which is what release_tagged expects
+    uint32_t track_tagged(void* addr, size_t size, size_t& accounted);
+    void release_tagged(void* addr, uint32_t scope, size_t size);
+}